@@ -69,6 +69,18 @@ void *memcpy(void *dst, const void *src, size_t n) {
     return dst;
 }
 
+int memcmp(const void *s1, const void *s2, size_t n) {
+    const uint8_t *p1 = (const uint8_t *)s1;
+    const uint8_t *p2 = (const uint8_t *)s2;
+    while (n--) {
+        if (*p1 != *p2)
+            return *p1 - *p2;
+        p1++;
+        p2++;
+    }
+    return 0;
+}
+
 void *memset(void *buf, char c, size_t n) {
     uint8_t *p = (uint8_t *)buf;
     while (n--) {
@@ -86,6 +98,13 @@ char *strcpy(char *dst, const char *src) {
     return dst;
 }
 
+size_t strlen(const char *s) {
+    size_t n = 0;
+    while (s[n])
+        n++;
+    return n;
+}
+
 int strcmp(const char *s1, const char *s2) {
     while (*s1 && *s2) {
         if (*s1 != *s2)
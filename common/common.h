@@ -29,9 +29,46 @@ typedef uint32_t vaddr_t;
 #define SYS_LS 6
 #define SYS_PS 7
 #define SYS_SBRK 8
+#define SYS_OPEN 9
+#define SYS_READ 10
+#define SYS_WRITE 11
+#define SYS_LSEEK 12
+#define SYS_CLOSE 13
+#define SYS_MMAP 14
+#define SYS_MUNMAP 15
+#define SYS_MSYNC 16
+#define SYS_FORK 17
+#define SYS_EXEC 18
+#define SYS_SLEEP 19
+#define SYS_SETPRIO 20
+#define SYS_WAIT 21
+#define SYS_LOCKSTAT 22
+
+// open()のフラグ
+#define O_RDONLY 0
+#define O_WRONLY 1
+#define O_RDWR 2
+#define O_ACCMODE 3
+#define O_CREAT (1 << 2)
+#define O_TRUNC (1 << 3)
+
+// lseek()のwhence
+#define SEEK_SET 0
+#define SEEK_CUR 1
+#define SEEK_END 2
+
+// mmap()のprot
+#define PROT_READ (1 << 0)
+#define PROT_WRITE (1 << 1)
+#define PROT_EXEC (1 << 2)
+
+// mmap()が失敗した時の戻り値
+#define MAP_FAILED ((void *)-1)
 
 void *memset(void *buf, char c, size_t n);
 void *memcpy(void *dst, const void *src, size_t n);
+int memcmp(const void *s1, const void *s2, size_t n);
 char *strcpy(char *dst, const char *src);
 int strcmp(const char *s1, const char *s2);
+size_t strlen(const char *s);
 void printf(const char *fmt, ...);
\ No newline at end of file
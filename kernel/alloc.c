@@ -1,20 +1,193 @@
 #include "common.h"
 #include "kernel.h"
 
-// メモリ管理
-paddr_t alloc_pages(uint32_t n) {
-  static paddr_t next_paddr = (paddr_t)__free_ram;
-  paddr_t paddr = next_paddr;
-  next_paddr += n * PAGE_SIZE;
+// 物理ページ管理 (バディアロケータ)
+struct page *pages; // __free_ram の各ページの管理情報
+uint32_t nr_pages;
+uint32_t nr_free_pages;
+struct page *free_area[MAX_ORDER + 1]; // オーダーごとの空きリスト
+struct spinlock page_lock;
 
-  if (next_paddr > (paddr_t)__free_ram_end)
-    PANIC("out of memory");
+static void page_list_push(struct page **head, struct page *page) {
+  page->prev = NULL;
+  page->next = *head;
+  if (page->next)
+    page->next->prev = page;
+  *head = page;
+}
+
+static void page_list_remove(struct page **head, struct page *page) {
+  if (page->prev)
+    page->prev->next = page->next;
+  else
+    *head = page->next;
+  if (page->next)
+    page->next->prev = page->prev;
+  page->next = page->prev = NULL;
+}
+
+static void free_area_push(struct page *page, int order) {
+  page->flags = PG_FREE;
+  page->order = order;
+  page_list_push(&free_area[order], page);
+}
+
+static void free_area_remove(struct page *page) {
+  page_list_remove(&free_area[page->order], page);
+  page->flags = 0;
+}
+
+struct page *paddr_to_page(paddr_t paddr) {
+  if (paddr < (paddr_t)__free_ram || paddr >= (paddr_t)__free_ram_end)
+    PANIC("invalid paddr %x", paddr);
+  return &pages[(paddr - (paddr_t)__free_ram) / PAGE_SIZE];
+}
+
+paddr_t page_to_paddr(struct page *page) {
+  return (paddr_t)__free_ram + (page - pages) * PAGE_SIZE;
+}
+
+// 指定オーダーのブロックを解放し、バディと結合できる限り結合する
+static void free_block(uint32_t idx, int order) {
+  while (order < MAX_ORDER) {
+    uint32_t buddy = idx ^ (1 << order);
+    if (buddy >= nr_pages || !(pages[buddy].flags & PG_FREE) ||
+        pages[buddy].order != order)
+      break;
+
+    free_area_remove(&pages[buddy]);
+    idx &= ~(1 << order);
+    order++;
+  }
+  free_area_push(&pages[idx], order);
+}
+
+// [idx, idx + n) を整列した2のべき乗ブロックに分けて解放する
+static void free_range(uint32_t idx, uint32_t n) {
+  nr_free_pages += n;
+  while (n > 0) {
+    int order = 0;
+    while (order < MAX_ORDER && (idx & ((2 << order) - 1)) == 0 &&
+           (2u << order) <= n)
+      order++;
 
+    free_block(idx, order);
+    idx += 1 << order;
+    n -= 1 << order;
+  }
+}
+
+void page_alloc_init(void) {
+  spin_init(&page_lock, "page_alloc");
+  nr_pages = ((paddr_t)__free_ram_end - (paddr_t)__free_ram) / PAGE_SIZE;
+
+  // 管理情報は空き領域の先頭に置き、そのページは予約扱いにする
+  pages = (struct page *)__free_ram;
+  uint32_t reserved =
+      align_up(nr_pages * sizeof(struct page), PAGE_SIZE) / PAGE_SIZE;
+  memset(pages, 0, reserved * PAGE_SIZE);
+
+  nr_free_pages = 0;
+  free_range(reserved, nr_pages - reserved);
+}
+
+// 空きがなければ0を返す (ユーザーのページフォルトなど、失敗できる場面で使う)
+paddr_t try_alloc_pages(uint32_t n) {
+  int order = 0;
+  while ((1u << order) < n)
+    order++;
+  if (order > MAX_ORDER)
+    PANIC("too many pages requested: %d", n);
+
+  spin_lock_irqsave(&page_lock);
+  int o = order;
+  while (o <= MAX_ORDER && !free_area[o])
+    o++;
+  if (o > MAX_ORDER) {
+    spin_unlock_irqrestore(&page_lock);
+    return 0;
+  }
+
+  struct page *page = free_area[o];
+  free_area_remove(page);
+  uint32_t idx = page - pages;
+
+  // 大きなブロックを分割し、余った半分を空きリストへ戻す
+  while (o > order) {
+    o--;
+    free_area_push(&pages[idx + (1 << o)], o);
+  }
+
+  nr_free_pages -= 1 << order;
+
+  // 2のべき乗に切り上げた分の末尾は返却する
+  if ((1u << order) > n)
+    free_range(idx + n, (1 << order) - n);
+  spin_unlock_irqrestore(&page_lock);
+
+  // ゼロ埋めはロックの外で行う
+  paddr_t paddr = page_to_paddr(page);
   memset((void *)paddr, 0, n * PAGE_SIZE);
   return paddr;
 }
 
-void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
+paddr_t alloc_pages(uint32_t n) {
+  paddr_t paddr = try_alloc_pages(n);
+  if (!paddr)
+    PANIC("out of memory");
+  return paddr;
+}
+
+void free_pages(paddr_t paddr, uint32_t n) {
+  if (!is_aligned(paddr, PAGE_SIZE))
+    PANIC("unaligned paddr %x", paddr);
+
+  struct page *page = paddr_to_page(paddr);
+  spin_lock_irqsave(&page_lock);
+  for (uint32_t i = 0; i < n; i++) {
+    if (page[i].flags & PG_FREE)
+      PANIC("double free: paddr=%x", paddr + i * PAGE_SIZE);
+  }
+
+  free_range(page - pages, n);
+  spin_unlock_irqrestore(&page_lock);
+}
+
+// ユーザーマッピングの参照を1つ外し、誰も使わなくなったページを解放する
+void put_page(paddr_t paddr) {
+  struct page *page = paddr_to_page(paddr);
+  if (page->refcount == 0)
+    PANIC("put_page: page %x is not mapped", paddr);
+
+  page->refcount--;
+  if (page->refcount == 0 && !(page->flags & PG_CACHE))
+    free_pages(paddr, 1);
+}
+
+// ページテーブルとユーザーページをすべて解放する
+void free_page_table(uint32_t *table1) {
+  for (int vpn1 = 0; vpn1 < 1024; vpn1++) {
+    uint32_t pte1 = table1[vpn1];
+    if (!(pte1 & PAGE_V) || (pte1 & (PAGE_R | PAGE_W | PAGE_X)))
+      continue;
+    if (pte1 == kernel_page_table[vpn1])
+      continue; // カーネルと共有しているテーブル
+
+    uint32_t *table0 = (uint32_t *)((pte1 >> 10) * PAGE_SIZE);
+    for (int vpn0 = 0; vpn0 < 1024; vpn0++) {
+      uint32_t pte0 = table0[vpn0];
+      // カーネル領域のマッピングはPAGE_Uを持たないので解放しない
+      if ((pte0 & PAGE_V) && (pte0 & PAGE_U))
+        put_page((pte0 >> 10) * PAGE_SIZE);
+    }
+    free_pages((paddr_t)table0, 1);
+  }
+  free_pages((paddr_t)table1, 1);
+}
+
+// ページテーブルを割り当てられなければfalse
+bool try_map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr,
+                  uint32_t flags) {
   if (!is_aligned(vaddr, PAGE_SIZE)) {
     PANIC("unaligned vaddr %x", vaddr);
   }
@@ -24,101 +197,305 @@ void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
   }
 
   uint32_t vpn1 = (vaddr >> 22) & 0x3FF;
+  if (table1[vpn1] & (PAGE_R | PAGE_W | PAGE_X)) {
+    PANIC("vaddr %x is already mapped by a megapage", vaddr);
+  }
+
   if ((table1[vpn1] & PAGE_V) == 0) {
-    uint32_t pt_paddr = alloc_pages(1);
+    uint32_t pt_paddr = try_alloc_pages(1);
+    if (!pt_paddr)
+      return false;
     table1[vpn1] = ((pt_paddr / PAGE_SIZE) << 10) | PAGE_V;
   }
 
   uint32_t vpn0 = (vaddr >> 12) & 0x3FF;
   uint32_t *table0 = (uint32_t *)((table1[vpn1] >> 10) * PAGE_SIZE);
   table0[vpn0] = ((paddr / PAGE_SIZE) << 10) | PAGE_V | flags;
+
+  // ユーザーページはマッピングの数を数えておく
+  if (flags & PAGE_U)
+    paddr_to_page(paddr)->refcount++;
+  return true;
 }
-// 動的メモリ管理（ヒープ）
-struct header {
-  struct header *next;
-  size_t size;
-};
 
-struct header free_list; // ダミーノード
+void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
+  if (!try_map_page(table1, vaddr, paddr, flags))
+    PANIC("out of memory");
+}
 
-void heap_init(void) {
-  free_list.next = NULL;
-  free_list.size = 0;
+// vaddrに対応する2段目のPTEを返す (テーブルがなければNULL)
+uint32_t *walk_pte(uint32_t *table1, uint32_t vaddr) {
+  uint32_t pte1 = table1[(vaddr >> 22) & 0x3FF];
+  if (!(pte1 & PAGE_V) || (pte1 & (PAGE_R | PAGE_W | PAGE_X)))
+    return NULL;
+
+  uint32_t *table0 = (uint32_t *)((pte1 >> 10) * PAGE_SIZE);
+  return &table0[(vaddr >> 12) & 0x3FF];
 }
 
-void *kmalloc(size_t size) {
-  struct header *curr = free_list.next;
-  struct header *prev = &free_list;
-  size_t total_size =
-      align_up(size + sizeof(struct header), 8); // 8バイトアライメント
-
-  // 空きリストから十分なサイズのブロックを探す
-  while (curr) {
-    if (curr->size >= total_size) {
-      if (curr->size >= total_size + sizeof(struct header) + 8) {
-        // 分割可能
-        struct header *new_node =
-            (struct header *)((uintptr_t)curr + total_size);
-        new_node->next = curr->next;
-        new_node->size = curr->size - total_size;
-        curr->next = new_node;
-        curr->size = total_size;
-      }
-
-      // リストから外す
-      prev->next = curr->next;
-      return (void *)(curr + 1); // ヘッダの直後を返す
-    }
-    prev = curr;
-    curr = curr->next;
-  }
-
-  // 空きがない場合、新しいページを割り当てる
-  int num_pages = align_up(total_size, PAGE_SIZE) / PAGE_SIZE;
-  struct header *new_block = (struct header *)alloc_pages(num_pages);
-  size_t block_size = num_pages * PAGE_SIZE;
-
-  if (block_size > total_size + sizeof(struct header) + 8) {
-    // 残りを空きリストに追加
-    struct header *remainder =
-        (struct header *)((uintptr_t)new_block + total_size);
-    remainder->size = block_size - total_size;
-    kfree((void *)(remainder + 1));
-    new_block->size = total_size;
-  } else {
-    new_block->size = block_size;
+// ユーザーページのマッピングを外す (TLBのフラッシュは呼び出し側で行う)
+void unmap_page(uint32_t *table1, uint32_t vaddr) {
+  uint32_t *pte = walk_pte(table1, vaddr);
+  if (!pte || !(*pte & PAGE_V))
+    return;
+
+  paddr_t paddr = (*pte >> 10) * PAGE_SIZE;
+  *pte = 0;
+  put_page(paddr);
+}
+
+// 4MBのメガページを1段目のテーブルに直接マッピングする
+void map_megapage(uint32_t *table1, uint32_t vaddr, paddr_t paddr,
+                  uint32_t flags) {
+  if (!is_aligned(vaddr, MEGAPAGE_SIZE)) {
+    PANIC("unaligned vaddr %x", vaddr);
   }
 
-  return (void *)(new_block + 1);
+  if (!is_aligned(paddr, MEGAPAGE_SIZE)) {
+    PANIC("unaligned paddr %x", paddr);
+  }
+
+  uint32_t vpn1 = (vaddr >> 22) & 0x3FF;
+  table1[vpn1] = ((paddr / PAGE_SIZE) << 10) | PAGE_V | flags;
 }
 
-void kfree(void *ptr) {
-  if (!ptr)
+// 全プロセスで共有するカーネル空間のページテーブル
+uint32_t *kernel_page_table;
+
+void kernel_page_table_init(void) {
+  kernel_page_table = (uint32_t *)alloc_pages(1);
+
+  paddr_t kernel_start = (paddr_t)__kernel_base & ~(MEGAPAGE_SIZE - 1);
+  paddr_t kernel_end = align_up((paddr_t)__free_ram_end, MEGAPAGE_SIZE);
+  for (paddr_t paddr = kernel_start; paddr < kernel_end;
+       paddr += MEGAPAGE_SIZE) {
+    map_megapage(kernel_page_table, paddr, paddr,
+                 PAGE_R | PAGE_W | PAGE_X | PAGE_G);
+  }
+
+  // VIRTIOのMMIO領域 (0x10000000 ~)
+  map_megapage(kernel_page_table, VIRTIO_BLK_PADDR & ~(MEGAPAGE_SIZE - 1),
+               VIRTIO_BLK_PADDR & ~(MEGAPAGE_SIZE - 1),
+               PAGE_R | PAGE_W | PAGE_G);
+
+  // PLICのMMIO領域 (0x0c000000 ~ 0x0c400000, 4MB)
+  map_megapage(kernel_page_table, PLIC_BASE, PLIC_BASE,
+               PAGE_R | PAGE_W | PAGE_G);
+
+  // カーネルスタック領域の2段目のテーブルは全プロセスのページテーブルで共有する
+  paddr_t kstack_table = alloc_pages(1);
+  kernel_page_table[(KSTACK_BASE >> 22) & 0x3FF] =
+      ((kstack_table / PAGE_SIZE) << 10) | PAGE_V;
+}
+
+// カーネル空間のマッピングをコピーした新しいページテーブルを作る
+uint32_t *create_page_table(void) {
+  uint32_t *table1 = (uint32_t *)alloc_pages(1);
+  memcpy(table1, kernel_page_table, PAGE_SIZE);
+  return table1;
+}
+
+void flush_tlb_all(void) { __asm__ __volatile__("sfence.vma" ::: "memory"); }
+
+void flush_tlb_asid(uint32_t asid) {
+  __asm__ __volatile__("sfence.vma zero, %0" ::"r"(asid) : "memory");
+}
+
+void flush_tlb_page(vaddr_t vaddr, uint32_t asid) {
+  __asm__ __volatile__("sfence.vma %0, %1" ::"r"(vaddr), "r"(asid) : "memory");
+}
+
+// グローバルなマッピングはすべてのASID・すべてのハートから消す
+void flush_tlb_kernel_range(vaddr_t start, size_t size) {
+  // hart_mask_base = -1 はすべてのハートを表す
+  sbi_call(0, -1, start, size, 0, 0, 1, SBI_EXT_RFENCE);
+}
+
+uint32_t asid_bits; // 0ならASIDを使わず、切り替えのたびにTLBを全部捨てる
+uint32_t asid_gen = 1;
+uint32_t asid_next = 1; // 0はアイドルプロセス用
+
+// satpのASIDフィールドに全部1を書き込み、実装されているビット数を調べる
+// (カーネルは恒等マッピングなので一時的にページングを有効にしても動く)
+void asid_init(void) {
+  WRITE_CSR(satp, SATP_SV32 | (SATP_ASID_MASK << SATP_ASID_SHIFT) |
+                      ((uint32_t)kernel_page_table / PAGE_SIZE));
+  uint32_t asid = (READ_CSR(satp) >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+  WRITE_CSR(satp, 0);
+  flush_tlb_all();
+
+  asid_bits = __builtin_popcount(asid);
+  printf("ASID bits: %d\n", asid_bits);
+}
+
+// 世代が古ければ新しいASIDを割り当てる。使い切ったら世代を進める
+static void asid_assign(struct process *proc) {
+  if (proc->asid_gen == asid_gen)
     return;
 
-  struct header *block = (struct header *)ptr - 1;
-  struct header *curr = free_list.next;
-  struct header *prev = &free_list;
+  if (asid_next == (1u << asid_bits)) {
+    asid_gen++;
+    asid_next = 1;
+  }
+  proc->asid = asid_next++;
+  proc->asid_gen = asid_gen;
+}
+
+void switch_page_table(struct process *proc) {
+  struct cpu *cpu = this_cpu();
+  if (asid_bits && proc != cpu->idle) {
+    asid_assign(proc);
+    if (cpu->asid_gen != asid_gen) {
+      // 前の世代のASIDは他のプロセスに割り当て直されている
+      flush_tlb_all();
+      cpu->asid_gen = asid_gen;
+    } else if (proc->cpu != cpu) {
+      // 別のハートで動いていた間のページテーブルの変更を反映する
+      flush_tlb_asid(proc->asid);
+    }
+  }
+  proc->cpu = cpu;
+
+  uint32_t satp = SATP_SV32 | (proc->asid << SATP_ASID_SHIFT) |
+                  ((uint32_t)proc->page_table / PAGE_SIZE);
+  WRITE_CSR(satp, satp);
+
+  // ASIDがなければ前のプロセスのエントリと区別できない
+  if (!asid_bits)
+    flush_tlb_all();
+}
+
+// 動的メモリ管理（スラブアロケータ）
+struct kmem_cache kmalloc_caches[KMALLOC_CLASSES];
+struct kmem_cache cache_cache; // kmem_cache自身のキャッシュ
+struct spinlock slab_lock;     // すべてのキャッシュで共有する
+
+static void kmem_cache_setup(struct kmem_cache *cache, const char *name,
+                             size_t size) {
+  cache->name = name;
+  cache->size = align_up(size < sizeof(void *) ? sizeof(void *) : size, 8);
+  cache->slab_pages =
+      align_up(cache->size * SLAB_MIN_OBJS, PAGE_SIZE) / PAGE_SIZE;
+  cache->objs_per_slab = cache->slab_pages * PAGE_SIZE / cache->size;
+  cache->partial = NULL;
+}
+
+void heap_init(void) {
+  spin_init(&slab_lock, "slab");
+  kmem_cache_setup(&cache_cache, "kmem_cache", sizeof(struct kmem_cache));
+  for (int i = 0; i < KMALLOC_CLASSES; i++)
+    kmem_cache_setup(&kmalloc_caches[i], "kmalloc", KMALLOC_MIN_SIZE << i);
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size) {
+  struct kmem_cache *cache = kmem_cache_alloc(&cache_cache);
+  kmem_cache_setup(cache, name, size);
+  return cache;
+}
+
+// 新しいスラブを割り当て、全オブジェクトを空きリストにつなぐ
+static struct page *slab_create(struct kmem_cache *cache) {
+  paddr_t paddr = alloc_pages(cache->slab_pages);
+  struct page *slab = paddr_to_page(paddr);
+  for (uint32_t i = 0; i < cache->slab_pages; i++) {
+    slab[i].flags = PG_SLAB;
+    slab[i].cache = cache;
+    slab[i].head = slab;
+  }
+
+  slab->inuse = 0;
+  slab->freelist = NULL;
+  for (int i = cache->objs_per_slab - 1; i >= 0; i--) {
+    void **obj = (void **)(paddr + i * cache->size);
+    *obj = slab->freelist;
+    slab->freelist = obj;
+  }
+  return slab;
+}
+
+static void slab_destroy(struct kmem_cache *cache, struct page *slab) {
+  for (uint32_t i = 0; i < cache->slab_pages; i++) {
+    slab[i].flags = 0;
+    slab[i].cache = NULL;
+    slab[i].head = NULL;
+  }
+  free_pages(page_to_paddr(slab), cache->slab_pages);
+}
 
-  // アドレス順になるように挿入位置を探す
-  while (curr && curr < block) {
-    prev = curr;
-    curr = curr->next;
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+  spin_lock_irqsave(&slab_lock);
+  struct page *slab = cache->partial;
+  if (!slab) {
+    slab = slab_create(cache);
+    page_list_push(&cache->partial, slab);
   }
 
-  // リストに挿入
-  block->next = curr;
-  prev->next = block;
+  void **obj = slab->freelist;
+  slab->freelist = *obj;
+  slab->inuse++;
 
-  // 右隣と結合できるか確認
-  if ((uintptr_t)block + block->size == (uintptr_t)block->next) {
-    block->size += block->next->size;
-    block->next = block->next->next;
+  // 満杯になったスラブは部分リストから外す
+  if (!slab->freelist)
+    page_list_remove(&cache->partial, slab);
+
+  spin_unlock_irqrestore(&slab_lock);
+  return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *ptr) {
+  struct page *slab = paddr_to_page((paddr_t)ptr & ~(PAGE_SIZE - 1))->head;
+  if (!slab || slab->cache != cache)
+    PANIC("kmem_cache_free: %x does not belong to %s", (uint32_t)ptr,
+          cache->name);
+
+  spin_lock_irqsave(&slab_lock);
+  bool was_full = !slab->freelist;
+  void **obj = ptr;
+  *obj = slab->freelist;
+  slab->freelist = obj;
+  slab->inuse--;
+
+  if (was_full)
+    page_list_push(&cache->partial, slab);
+
+  // 空になったスラブは、他に部分スラブがあればページを返却する
+  if (slab->inuse == 0 && (cache->partial != slab || slab->next)) {
+    page_list_remove(&cache->partial, slab);
+    slab_destroy(cache, slab);
   }
+  spin_unlock_irqrestore(&slab_lock);
+}
 
-  // 左隣と結合できるか確認
-  if ((uintptr_t)prev + prev->size == (uintptr_t)block) {
-    prev->size += block->size;
-    prev->next = block->next;
+void *kmalloc(size_t size) {
+  if (size > KMALLOC_MAX_SIZE) {
+    // 大きな割り当てはページ単位で確保する
+    uint32_t num_pages = align_up(size, PAGE_SIZE) / PAGE_SIZE;
+    paddr_t paddr = alloc_pages(num_pages);
+    struct page *page = paddr_to_page(paddr);
+    page->flags = PG_LARGE;
+    page->inuse = num_pages;
+    return (void *)paddr;
+  }
+
+  int index = 0;
+  if (size > KMALLOC_MIN_SIZE)
+    index = (32 - __builtin_clz(size - 1)) - KMALLOC_MIN_SHIFT;
+  return kmem_cache_alloc(&kmalloc_caches[index]);
+}
+
+void kfree(void *ptr) {
+  if (!ptr)
+    return;
+
+  struct page *page = paddr_to_page((paddr_t)ptr & ~(PAGE_SIZE - 1));
+  if (page->flags & PG_SLAB) {
+    kmem_cache_free(page->cache, ptr);
+  } else if (page->flags & PG_LARGE) {
+    uint32_t num_pages = page->inuse;
+    page->flags = 0;
+    page->inuse = 0;
+    free_pages((paddr_t)ptr, num_pages);
+  } else {
+    PANIC("kfree: invalid pointer %x", (uint32_t)ptr);
   }
 }
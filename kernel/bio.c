@@ -0,0 +1,210 @@
+#include "common.h"
+#include "kernel.h"
+
+// セクタ単位のバッファキャッシュ (LRU + ライトバック)
+struct buf bufs[BIO_NBUF];
+struct buf *bio_hash[BIO_HASH_SIZE];
+struct buf *lru_head; // 最近使われた順 (先頭が最新)
+struct buf *lru_tail;
+struct wait_queue bio_wq;
+
+static struct buf **bio_hash_slot(unsigned sector) {
+  return &bio_hash[sector & (BIO_HASH_SIZE - 1)];
+}
+
+static void bio_hash_remove(struct buf *b) {
+  struct buf **p = bio_hash_slot(b->sector);
+  while (*p && *p != b)
+    p = &(*p)->hash_next;
+  if (*p)
+    *p = b->hash_next;
+  b->hash_next = NULL;
+}
+
+static void lru_remove(struct buf *b) {
+  if (b->lru_prev)
+    b->lru_prev->lru_next = b->lru_next;
+  else
+    lru_head = b->lru_next;
+  if (b->lru_next)
+    b->lru_next->lru_prev = b->lru_prev;
+  else
+    lru_tail = b->lru_prev;
+}
+
+static void lru_push_front(struct buf *b) {
+  b->lru_prev = NULL;
+  b->lru_next = lru_head;
+  if (lru_head)
+    lru_head->lru_prev = b;
+  else
+    lru_tail = b;
+  lru_head = b;
+}
+
+void bio_init(void) {
+  for (int i = 0; i < BIO_NBUF; i++) {
+    bufs[i].sector = 0;
+    bufs[i].flags = 0;
+    bufs[i].refcnt = 0;
+    lru_push_front(&bufs[i]);
+  }
+}
+
+static struct buf *bio_lookup(unsigned sector) {
+  for (struct buf *b = *bio_hash_slot(sector); b; b = b->hash_next) {
+    if (b->sector == sector)
+      return b;
+  }
+  return NULL;
+}
+
+// I/O中のバッファが解放されるのを待つ
+static void bio_wait(void) {
+  if (!can_sleep())
+    PANIC("buffer is busy");
+  sleep_on(&bio_wq);
+}
+
+static void bio_unbusy(struct buf *b) {
+  b->flags &= ~BUF_BUSY;
+  wake_up(&bio_wq);
+}
+
+// 連続するセクタのバッファ列を1つの要求で読み書きする
+static void bio_submit_run(struct buf **run, int n, int is_write) {
+  struct iovec iov[BLK_MAX_SEGS];
+  for (int i = 0; i < n; i++) {
+    iov[i].base = run[i]->data;
+    iov[i].len = SECTOR_SIZE;
+    run[i]->flags |= BUF_BUSY;
+    if (is_write)
+      run[i]->flags &= ~BUF_DIRTY;
+  }
+
+  int ret = blk_submit(run[0]->sector, n, iov, n, is_write);
+
+  for (int i = 0; i < n; i++) {
+    if (ret == 0)
+      run[i]->flags |= BUF_VALID;
+    else if (is_write)
+      run[i]->flags |= BUF_DIRTY;
+    bio_unbusy(run[i]);
+  }
+}
+
+// セクタのバッファを参照する (内容は読み込まない)
+struct buf *bget(unsigned sector) {
+  struct buf *b;
+  for (;;) {
+    b = bio_lookup(sector);
+    if (b) {
+      if (b->flags & BUF_BUSY) {
+        bio_wait();
+        continue;
+      }
+      break;
+    }
+
+    // 使われていない最も古いバッファを追い出す
+    b = lru_tail;
+    while (b && (b->refcnt > 0 || (b->flags & BUF_BUSY)))
+      b = b->lru_prev;
+    if (!b)
+      PANIC("no free buffers");
+
+    if (b->flags & BUF_DIRTY) {
+      // 書き戻し中にスリープするので探索からやり直す
+      bio_submit_run(&b, 1, true);
+      continue;
+    }
+
+    bio_hash_remove(b);
+    b->sector = sector;
+    b->flags = 0;
+    b->hash_next = *bio_hash_slot(sector);
+    *bio_hash_slot(sector) = b;
+    break;
+  }
+
+  b->refcnt++;
+  lru_remove(b);
+  lru_push_front(b);
+  return b;
+}
+
+struct buf *bread(unsigned sector) {
+  struct buf *b = bget(sector);
+  if (!(b->flags & BUF_VALID))
+    bio_submit_run(&b, 1, false);
+  return b;
+}
+
+void brelse(struct buf *b) {
+  if (b->refcnt <= 0)
+    PANIC("brelse: buffer %d is not referenced", b->sector);
+  b->refcnt--;
+}
+
+void bdirty(struct buf *b) { b->flags |= BUF_VALID | BUF_DIRTY; }
+
+// セクタ全体を上書きする。内容が変わらなければ書き込み対象にしない
+void bio_write(unsigned sector, const void *data) {
+  struct buf *b = bget(sector);
+  if (!(b->flags & BUF_VALID) || memcmp(b->data, data, SECTOR_SIZE) != 0) {
+    memcpy(b->data, data, SECTOR_SIZE);
+    bdirty(b);
+  }
+  brelse(b);
+}
+
+// キャッシュを介さずに書き込むセクタの古いバッファを捨てる
+void bio_invalidate(unsigned sector, unsigned n) {
+  for (unsigned s = sector; s < sector + n; s++) {
+    struct buf *b = bio_lookup(s);
+    if (!b)
+      continue;
+    while (b->flags & BUF_BUSY)
+      bio_wait();
+    if (b->refcnt == 0 && b->sector == s) {
+      bio_hash_remove(b);
+      b->flags = 0;
+    }
+  }
+}
+
+// ダーティなバッファをセクタ順に並べ、連続する区間ごとにまとめて書き戻す
+int bio_sync(void) {
+  struct buf *dirty[BIO_NBUF];
+  int n = 0;
+  for (int i = 0; i < BIO_NBUF; i++) {
+    struct buf *b = &bufs[i];
+    if ((b->flags & BUF_DIRTY) && !(b->flags & BUF_BUSY)) {
+      b->refcnt++; // 書き戻しの途中で追い出されないようにする
+      dirty[n++] = b;
+    }
+  }
+
+  for (int i = 1; i < n; i++) {
+    struct buf *b = dirty[i];
+    int j = i - 1;
+    while (j >= 0 && dirty[j]->sector > b->sector) {
+      dirty[j + 1] = dirty[j];
+      j--;
+    }
+    dirty[j + 1] = b;
+  }
+
+  int start = 0;
+  for (int i = 1; i <= n; i++) {
+    if (i == n || dirty[i]->sector != dirty[i - 1]->sector + 1 ||
+        i - start == BLK_MAX_SEGS) {
+      bio_submit_run(&dirty[start], i - start, true);
+      start = i;
+    }
+  }
+
+  for (int i = 0; i < n; i++)
+    brelse(dirty[i]);
+  return n;
+}
@@ -0,0 +1,110 @@
+#include "common.h"
+#include "kernel.h"
+
+static int elf_to_prot(uint32_t p_flags) {
+  int prot = 0;
+  if (p_flags & PF_R)
+    prot |= PROT_READ;
+  if (p_flags & PF_W)
+    prot |= PROT_WRITE;
+  if (p_flags & PF_X)
+    prot |= PROT_EXEC;
+  return prot;
+}
+
+// ELFのプログラムヘッダを読み、PT_LOADのセグメントをvmasに並べる
+static int load_segments(struct file *file, struct elf32_ehdr *ehdr,
+                         struct vm_area *vmas, vaddr_t *heap_start) {
+  // プログラムヘッダの表がファイルに収まっていること
+  uint32_t table_size = ehdr->e_phnum * sizeof(struct elf32_phdr);
+  if (ehdr->e_phentsize != sizeof(struct elf32_phdr) || ehdr->e_phnum == 0 ||
+      ehdr->e_phoff > file->size || table_size > file->size - ehdr->e_phoff)
+    return -1;
+
+  int n = 0;
+  for (int i = 0; i < ehdr->e_phnum; i++) {
+    struct elf32_phdr ph;
+    uint32_t off = ehdr->e_phoff + i * sizeof(ph);
+    if (fs_read(file, off, &ph, sizeof(ph)) != sizeof(ph))
+      return -1;
+    if (ph.p_type != PT_LOAD || ph.p_memsz == 0)
+      continue;
+
+    // ファイル上の範囲がファイルに収まり、アドレスの計算が桁あふれしないこと
+    if (ph.p_filesz > ph.p_memsz || ph.p_offset > file->size ||
+        ph.p_filesz > file->size - ph.p_offset || ph.p_vaddr > USER_STACK_TOP ||
+        ph.p_memsz > USER_STACK_TOP - ph.p_vaddr)
+      return -1;
+
+    vaddr_t start = ph.p_vaddr & ~(PAGE_SIZE - 1);
+    vaddr_t end = align_up(ph.p_vaddr + ph.p_memsz, PAGE_SIZE);
+    // セグメントはアドレス順に並び、ページを共有していないこと
+    if (n == VMAS_MAX - 1 ||
+        ph.p_offset % PAGE_SIZE != ph.p_vaddr % PAGE_SIZE ||
+        start < USER_BASE || end > USER_STACK_TOP - USER_STACK_SIZE ||
+        (n > 0 && start < vmas[n - 1].end))
+      return -1;
+
+    vmas[n].start = start;
+    vmas[n].end = end;
+    vmas[n].file = file;
+    vmas[n].offset = ph.p_offset & ~(PAGE_SIZE - 1);
+    vmas[n].filesz = ph.p_filesz + ph.p_vaddr % PAGE_SIZE;
+    vmas[n].prot = elf_to_prot(ph.p_flags);
+    vmas[n].flags = 0;
+    *heap_start = end;
+    n++;
+  }
+  return n;
+}
+
+// 現在のプロセスのアドレス空間をELFファイルのものに置き換える
+// セグメントの中身は最初にアクセスされた時にページキャッシュから読む
+int exec_process(struct trap_frame *f, const char *path) {
+  struct file *file = fs_lookup(path);
+  if (!file)
+    return -1;
+
+  struct elf32_ehdr ehdr;
+  if (fs_read(file, 0, &ehdr, sizeof(ehdr)) != sizeof(ehdr) ||
+      memcmp(ehdr.e_ident, "\x7f" "ELF", 4) != 0 ||
+      ehdr.e_ident[4] != ELFCLASS32 || ehdr.e_type != ET_EXEC ||
+      ehdr.e_machine != EM_RISCV) {
+    printf("exec: %s: not an executable\n", path);
+    return -1;
+  }
+
+  struct vm_area vmas[VMAS_MAX];
+  memset(vmas, 0, sizeof(vmas));
+  vaddr_t heap_start = 0;
+  int n = load_segments(file, &ehdr, vmas, &heap_start);
+  if (n <= 0) {
+    printf("exec: %s: invalid program headers\n", path);
+    return -1;
+  }
+
+  // スタックはゼロ埋めの匿名メモリ
+  vmas[n].start = USER_STACK_TOP - USER_STACK_SIZE;
+  vmas[n].end = USER_STACK_TOP;
+  vmas[n].prot = PROT_READ | PROT_WRITE;
+
+  // ここから先は失敗しないので、古いアドレス空間を捨てる
+  struct process *proc = current_proc;
+  vm_unmap_all(proc);
+  uint32_t *old_table = proc->page_table;
+  proc->page_table = create_page_table();
+  // 同じASIDのまま新しいページテーブルに切り替えるので古いエントリを捨てる
+  switch_page_table(proc);
+  flush_tlb_asid(proc->asid);
+  free_page_table(old_table);
+
+  memcpy(proc->vmas, vmas, sizeof(vmas));
+  proc->heap_start = heap_start;
+  proc->brk = heap_start;
+  proc->mmap_top = MMAP_BASE;
+
+  memset(f, 0, sizeof(*f));
+  f->sp = USER_STACK_TOP;
+  f->sepc = ehdr.e_entry;
+  return 0;
+}
@@ -1,8 +1,11 @@
 #include "common.h"
 #include "kernel.h"
 
-struct file files[FILES_MAX];
-uint8_t disk[DISK_MAX_SIZE];
+struct file *fs_files; // マウント順のファイル一覧
+struct file *fs_files_tail;
+struct file *fs_hash[FS_HASH_SIZE]; // ファイル名のハッシュ表
+struct kmem_cache *file_cache;
+unsigned fs_end_sector; // アーカイブの終端 (次に追記するセクタ)
 
 int oct2int(char *oct, int len) {
   int dec = 0;
@@ -15,78 +18,371 @@ int oct2int(char *oct, int len) {
   return dec;
 }
 
-void fs_init(void) {
-  for (unsigned sector = 0; sector < sizeof(disk) / SECTOR_SIZE; sector++) {
-    if (sector * SECTOR_SIZE >= blk_capacity)
-      break;
-    read_write_disk(&disk[sector * SECTOR_SIZE], sector, false);
+static uint32_t fs_hash_name(const char *name) {
+  uint32_t h = 2166136261u; // FNV-1a
+  while (*name) {
+    h ^= (uint8_t)*name++;
+    h *= 16777619u;
+  }
+  return h & (FS_HASH_SIZE - 1);
+}
+
+static void fs_index_insert(struct file *file) {
+  uint32_t h = fs_hash_name(file->name);
+  file->hash_next = fs_hash[h];
+  fs_hash[h] = file;
+}
+
+// アーカイブに使えるセクタ数
+static unsigned fs_max_sectors(void) { return blk_capacity / SECTOR_SIZE; }
+
+static unsigned sectors_for(size_t size) {
+  return align_up(size, SECTOR_SIZE) / SECTOR_SIZE;
+}
+
+static struct file *fs_alloc_file(const char *name) {
+  struct file *file = kmem_cache_alloc(file_cache);
+  memset(file, 0, sizeof(*file));
+  strcpy(file->name, name);
+
+  if (fs_files_tail)
+    fs_files_tail->next = file;
+  else
+    fs_files = file;
+  fs_files_tail = file;
+  fs_index_insert(file);
+  return file;
+}
+
+// ページキャッシュの配列を少なくともnpages分に広げる
+static void fs_reserve_pages(struct file *file, uint32_t npages) {
+  if (npages <= file->page_cap)
+    return;
+
+  uint32_t cap = file->page_cap ? file->page_cap : 4;
+  while (cap < npages)
+    cap *= 2;
+
+  paddr_t *pages = kmalloc(cap * sizeof(paddr_t));
+  memset(pages, 0, cap * sizeof(paddr_t));
+  if (file->pages) {
+    memcpy(pages, file->pages, file->page_cap * sizeof(paddr_t));
+    kfree(file->pages);
   }
+  file->pages = pages;
+  file->page_cap = cap;
+}
+
+// マウント時はヘッダだけを読み、データは最初のアクセスで読み込む
+void fs_init(void) {
+  file_cache = kmem_cache_create("file", sizeof(struct file));
 
-  unsigned off = 0;
-  for (int i = 0; i < FILES_MAX; i++) {
-    struct tar_header *header = (struct tar_header *)&disk[off];
-    if (header->name[0] == '\0')
+  unsigned sector = 0;
+  while (sector < fs_max_sectors()) {
+    struct buf *b = bread(sector);
+    struct tar_header *header = (struct tar_header *)b->data;
+    if (header->name[0] == '\0') {
+      brelse(b);
       break;
+    }
 
     if (strcmp(header->magic, "ustar") != 0)
       PANIC("invalid tar header: magic=\"%s\"", header->magic);
 
     int filesz = oct2int(header->size, sizeof(header->size));
-    struct file *file = &files[i];
-    file->in_use = true;
-    strcpy(file->name, header->name);
-    memcpy(file->data, header->data, filesz);
+
+    // 同じ名前が後ろに追記されていれば、そちらが最新の内容
+    struct file *file = fs_lookup(header->name);
+    if (!file)
+      file = fs_alloc_file(header->name);
+
+    fs_truncate(file, 0);
     file->size = filesz;
+    file->sector = sector;
+    file->extent.start = sector + 1;
+    file->extent.len = sectors_for(filesz);
+    file->dirty = false;
     printf("file: %s, size=%d\n", file->name, file->size);
 
-    off += align_up(sizeof(struct tar_header) + filesz, SECTOR_SIZE);
+    brelse(b);
+    sector += 1 + file->extent.len;
   }
+  fs_end_sector = sector;
 }
 
-void fs_flush(void) {
-  memset(disk, 0, sizeof(disk));
-  unsigned off = 0;
-  for (int file_i = 0; file_i < FILES_MAX; file_i++) {
-    struct file *file = &files[file_i];
-    if (!file->in_use)
+// ファイルのindex番目のページを返す。未読み込みならエクステントから読む
+// 読み込みやページの割り当てに失敗したら0を返す
+paddr_t fs_get_page(struct file *file, uint32_t index) {
+  fs_reserve_pages(file, index + 1);
+  if (file->pages[index])
+    return file->pages[index];
+
+  // ファイルサイズより後ろの部分はディスクから読む必要がない
+  unsigned valid = sectors_for(file->size);
+  if (valid > file->extent.len)
+    valid = file->extent.len;
+
+  paddr_t paddr = try_alloc_pages(1);
+  if (!paddr)
+    return 0;
+  unsigned first = index * (PAGE_SIZE / SECTOR_SIZE);
+  if (first < valid) {
+    unsigned n = valid - first;
+    if (n > PAGE_SIZE / SECTOR_SIZE)
+      n = PAGE_SIZE / SECTOR_SIZE;
+
+    // ページキャッシュへ直接DMAする
+    struct iovec iov = {.base = (void *)paddr, .len = n * SECTOR_SIZE};
+    if (blk_submit(file->extent.start + first, n, &iov, 1, false) < 0) {
+      // ゼロのページをキャッシュすると書き戻しでディスクを壊してしまう
+      free_pages(paddr, 1);
+      return 0;
+    }
+  }
+
+  // 読み込み中に他のプロセスが同じページを用意していればそちらを使う
+  if (file->pages[index]) {
+    free_pages(paddr, 1);
+    return file->pages[index];
+  }
+
+  paddr_to_page(paddr)->flags |= PG_CACHE;
+  file->pages[index] = paddr;
+  return paddr;
+}
+
+int fs_read(struct file *file, uint32_t off, void *buf, size_t len) {
+  if (off >= file->size)
+    return 0;
+  if (len > file->size - off)
+    len = file->size - off;
+
+  size_t done = 0;
+  while (done < len) {
+    uint32_t pos = off + done;
+    uint32_t page_off = pos % PAGE_SIZE;
+    size_t n = PAGE_SIZE - page_off;
+    if (n > len - done)
+      n = len - done;
+
+    paddr_t page = fs_get_page(file, pos / PAGE_SIZE);
+    if (!page)
+      break;
+    memcpy((uint8_t *)buf + done, (void *)(page + page_off), n);
+    done += n;
+  }
+  return (done == 0 && len > 0) ? -1 : (int)done;
+}
+
+int fs_write(struct file *file, uint32_t off, const void *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    uint32_t pos = off + done;
+    uint32_t page_off = pos % PAGE_SIZE;
+    size_t n = PAGE_SIZE - page_off;
+    if (n > len - done)
+      n = len - done;
+
+    paddr_t page = fs_get_page(file, pos / PAGE_SIZE);
+    if (!page)
+      break;
+    memcpy((void *)(page + page_off), (const uint8_t *)buf + done, n);
+    paddr_to_page(page)->flags |= PG_DIRTY;
+    done += n;
+  }
+
+  if (done == 0 && len > 0)
+    return -1;
+  if (off + done > file->size)
+    file->size = off + done;
+  file->dirty = true;
+  return done;
+}
+
+// sizeより後ろのページキャッシュを捨てる
+void fs_truncate(struct file *file, size_t size) {
+  uint32_t keep = align_up(size, PAGE_SIZE) / PAGE_SIZE;
+  for (uint32_t i = keep; i < file->page_cap; i++) {
+    if (file->pages[i]) {
+      // mmapされているページはマッピングが外れた時に解放される
+      struct page *page = paddr_to_page(file->pages[i]);
+      page->flags &= ~(PG_DIRTY | PG_CACHE);
+      if (page->refcount == 0)
+        free_pages(file->pages[i], 1);
+      file->pages[i] = 0;
+    }
+  }
+
+  // 残る最後のページの末尾はゼロにしておく (tarのパディング)
+  if (size % PAGE_SIZE && keep <= file->page_cap && file->pages[keep - 1]) {
+    paddr_t page = file->pages[keep - 1];
+    memset((void *)(page + size % PAGE_SIZE), 0,
+           PAGE_SIZE - size % PAGE_SIZE);
+  }
+
+  if (size != file->size) {
+    file->size = size;
+    file->dirty = true;
+  }
+}
+
+static void fs_build_header(struct file *file, struct tar_header *header) {
+  memset(header, 0, SECTOR_SIZE);
+  strcpy(header->name, file->name);
+  strcpy(header->mode, "000644");
+  strcpy(header->magic, "ustar");
+  strcpy(header->version, "00");
+  header->type = '0';
+
+  int filesz = file->size;
+  for (int i = sizeof(header->size); i > 0; i--) {
+    header->size[i - 1] = (filesz % 8) + '0';
+    filesz /= 8;
+  }
+
+  int checksum = ' ' * sizeof(header->checksum);
+  for (unsigned i = 0; i < sizeof(struct tar_header); i++)
+    checksum += ((unsigned char *)header)[i];
+
+  for (int i = 5; i >= 0; i--) {
+    header->checksum[i] = (checksum % 8) + '0';
+    checksum /= 8;
+  }
+}
+
+// ダーティなページを、連続するものはまとめて1つの要求で書き出す
+static int fs_write_pages(struct file *file) {
+  uint32_t npages = align_up(file->size, PAGE_SIZE) / PAGE_SIZE;
+  struct iovec iov[BLK_MAX_SEGS];
+  int iovcnt = 0;
+  unsigned start = 0;
+  unsigned nsectors = 0;
+  int written = 0;
+  bool failed = false;
+
+  for (uint32_t i = 0; i <= npages; i++) {
+    struct page *page = NULL;
+    if (i < npages && i < file->page_cap && file->pages[i])
+      page = paddr_to_page(file->pages[i]);
+
+    if (page && (page->flags & PG_DIRTY) && iovcnt < BLK_MAX_SEGS) {
+      unsigned first = i * (PAGE_SIZE / SECTOR_SIZE);
+      unsigned n = file->extent.len - first;
+      if (n > PAGE_SIZE / SECTOR_SIZE)
+        n = PAGE_SIZE / SECTOR_SIZE;
+
+      if (iovcnt == 0)
+        start = file->extent.start + first;
+      iov[iovcnt].base = (void *)file->pages[i];
+      iov[iovcnt].len = n * SECTOR_SIZE;
+      iovcnt++;
+      nsectors += n;
+      page->flags &= ~PG_DIRTY;
       continue;
+    }
 
-    struct tar_header *header = (struct tar_header *)&disk[off];
-    memset(header, 0, sizeof(*header));
-    strcpy(header->name, file->name);
-    strcpy(header->mode, "000644");
-    strcpy(header->magic, "ustar");
-    strcpy(header->version, "00");
-    header->type = '0';
-
-    int filesz = file->size;
-    for (int i = sizeof(header->size); i > 0; i--) {
-      header->size[i - 1] = (filesz % 8) + '0';
-      filesz /= 8;
+    if (iovcnt > 0) {
+      bio_invalidate(start, nsectors);
+      if (blk_submit(start, nsectors, iov, iovcnt, true) < 0) {
+        // 書けなかったページは次の書き戻しでやり直す
+        for (int j = 0; j < iovcnt; j++)
+          paddr_to_page((paddr_t)iov[j].base)->flags |= PG_DIRTY;
+        failed = true;
+      } else {
+        written += nsectors;
+      }
+      iovcnt = 0;
+      nsectors = 0;
+      if (page && (page->flags & PG_DIRTY))
+        i--; // セグメント数の上限で区切ったので、このページからやり直す
     }
+  }
+  return failed ? -1 : written;
+}
 
-    int checksum = ' ' * sizeof(header->checksum);
-    for (unsigned i = 0; i < sizeof(struct tar_header); i++)
-      checksum += (unsigned char)disk[off + i];
+// ファイルのヘッダとダーティなデータだけを書き出す。失敗したら-1
+static int fs_flush_file(struct file *file) {
+  uint8_t sector_buf[SECTOR_SIZE];
+  unsigned nsectors = sectors_for(file->size);
 
-    for (int i = 5; i >= 0; i--) {
-      header->checksum[i] = (checksum % 8) + '0';
-      checksum /= 8;
+  // 新規作成したファイル (extent.start == 0) もまだディスク上に場所がない
+  if (file->extent.start == 0 || nsectors != file->extent.len) {
+    // tarはヘッダのサイズで次のエントリを探すので、大きさが変わったら
+    // 元の場所では書き直せない。アーカイブの末尾へ追記する
+    // (古いエントリはそのまま残り、マウント時に後ろのものが優先される)
+    if (fs_end_sector + 1 + nsectors + 2 > fs_max_sectors()) {
+      printf("fs: no space left for %s\n", file->name);
+      return -1;
     }
 
-    memcpy(header->data, file->data, file->size);
-    off += align_up(sizeof(struct tar_header) + file->size, SECTOR_SIZE);
+    // 旧エクステントの内容を読み込んでから、全ページを新しい場所へ書く
+    uint32_t npages = align_up(file->size, PAGE_SIZE) / PAGE_SIZE;
+    for (uint32_t i = 0; i < npages; i++) {
+      paddr_t page = fs_get_page(file, i);
+      if (!page) {
+        printf("fs: failed to read %s\n", file->name);
+        return -1;
+      }
+      paddr_to_page(page)->flags |= PG_DIRTY;
+    }
+
+    file->sector = fs_end_sector;
+    file->extent.start = fs_end_sector + 1;
+    file->extent.len = nsectors;
+    fs_end_sector += 1 + nsectors;
+
+    // アーカイブの終端 (ゼロブロック2つ)
+    memset(sector_buf, 0, SECTOR_SIZE);
+    bio_write(fs_end_sector, sector_buf);
+    bio_write(fs_end_sector + 1, sector_buf);
+  }
+
+  // データを書けなかった時はヘッダを書かず、ダーティのまま残す
+  int written = fs_write_pages(file);
+  if (written < 0) {
+    printf("fs: failed to write %s\n", file->name);
+    return -1;
   }
 
-  for (unsigned sector = 0; sector < sizeof(disk) / SECTOR_SIZE; sector++)
-    read_write_disk(&disk[sector * SECTOR_SIZE], sector, true);
+  fs_build_header(file, (struct tar_header *)sector_buf);
+  bio_write(file->sector, sector_buf);
+  file->dirty = false;
+  return written;
+}
+
+void fs_flush(void) {
+  int written = 0;
+  for (struct file *file = fs_files; file; file = file->next) {
+    int n = file->dirty ? fs_flush_file(file) : 0;
+    if (n > 0)
+      written += n;
+  }
+
+  written += bio_sync();
+  printf("wrote %d sectors to disk\n", written);
+}
+
+// 1つのファイルだけを書き戻す。失敗したら-1
+int fs_fsync(struct file *file) {
+  int ret = 0;
+  if (file->dirty && fs_flush_file(file) < 0)
+    ret = -1;
+  bio_sync();
+  return ret;
+}
+
+struct file *fs_create(const char *filename) {
+  if (strlen(filename) >= sizeof(((struct file *)0)->name))
+    return NULL;
 
-  printf("wrote %d bytes to disk\n", sizeof(disk));
+  struct file *file = fs_alloc_file(filename);
+  file->dirty = true;
+  return file;
 }
 
 struct file *fs_lookup(const char *filename) {
-  for (int i = 0; i < FILES_MAX; i++) {
-    struct file *file = &files[i];
+  for (struct file *file = fs_hash[fs_hash_name(filename)]; file;
+       file = file->hash_next) {
     if (!strcmp(file->name, filename))
       return file;
   }
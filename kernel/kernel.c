@@ -2,16 +2,17 @@
 #include "common.h"
 
 // ブートコード (カーネルエントリポイント)
+// OpenSBIはa0にハートIDを入れて1つのハートだけをここへ飛ばす
 __attribute__((section(".text.boot"))) __attribute__((naked)) void boot(void) {
-  __asm__ __volatile__("mv sp, %[stack_top]\n"
-                       "j kernel_main\n"
-                       :
-                       : [stack_top] "r"(__stack_top));
+  __asm__ __volatile__("la sp, __stack_top\n"
+                       "j kernel_main\n");
 }
 
-void kernel_main(void) {
+void kernel_main(uint32_t hartid) {
   // BSS領域をゼロ初期化
   memset(__bss, 0, (size_t)__bss_end - (size_t)__bss);
+  cpu_init(hartid);
+  spin_init(&big_kernel_lock, "kernel");
 
   // コンソールテスト
   const char *s = "\n\nHello World!\n";
@@ -22,13 +23,19 @@ void kernel_main(void) {
   printf("1 + 2 = %d, %x\n", 1 + 2, 0x1234abcd);
 
   // メモリ割り当てテスト
+  page_alloc_init();
+  uint32_t free_before = nr_free_pages;
   paddr_t paddr0 = alloc_pages(2);
   paddr_t paddr1 = alloc_pages(1);
   printf("alloc_pages test: paddr0=%x\n", paddr0);
   printf("alloc_pages test: paddr1=%x\n", paddr1);
+  free_pages(paddr0, 2);
+  free_pages(paddr1, 1);
+  if (nr_free_pages != free_before)
+    PANIC("free_pages test failed: %d != %d", nr_free_pages, free_before);
+  printf("free pages: %d\n", nr_free_pages);
 
   // ヒープ初期化
-  void heap_init(void);
   heap_init();
 
   // kmallocテスト
@@ -44,38 +51,27 @@ void kernel_main(void) {
   // ハードウェア初期化
   plic_init();
   virtio_blk_init();
+  bio_init();
   virtio_gpu_init();
   virtio_input_init();
+  uart_init();
   fs_init();
 
-  // ディスクテスト
-  char buf[SECTOR_SIZE];
-  read_write_disk(buf, 0, false);
-  printf("first sector: %s\n", buf);
-
-  strcpy(buf, "hello from kernel!!!\n");
-  read_write_disk(buf, 0, true);
+  // ディスクテスト (キャッシュ経由)
+  struct buf *b = bread(0);
+  printf("first sector: %s\n", b->data);
+  brelse(b);
 
   // プロセス初期化
+  kernel_page_table_init();
+  asid_init();
   idle_proc = create_process(NULL, 0);
   idle_proc->pid = 0;
   current_proc = idle_proc;
 
   create_process(_binary_shell_bin_start, (size_t)_binary_shell_bin_size);
 
-  // タイマー設定 (初回)
-  // ここで初回のタイマー割り込みをセットする
-  uint64_t current_time;
-  __asm__ volatile("rdtime %0" : "=r"(current_time));
-  sbi_call(current_time + 100000, 0, 0, 0, 0, 0, 0, 0);
-
-  // タイマー割り込み有効化 (Supervisor Timer Interrupt Enable)
-  WRITE_CSR(sie, READ_CSR(sie) | (1 << 5));
-
-  yield();
-  PANIC("switched to idle process");
-
-  while (1) {
-    __asm__ __volatile__("wfi");
-  }
+  // 残りのハートを起動し、このハートもアイドルループに入る
+  smp_init();
+  cpu_idle();
 }
@@ -1,24 +1,64 @@
 #pragma once
 #include "common.h"
 
-#define PROCS_MAX 8
+#define PROCS_MAX 256 // プロセス表はここまで動的に広がる
 #define PROCS_UNUSED 0
 #define PROCS_RUNNABLE 1
-#define PROC_EXITED 2
+#define PROC_EXITED 2 // 親がwaitするまで残る (ゾンビ)
+#define PROC_BLOCKED 3
+#define NR_PRIO 8 // 優先度の段階 (0が最高)
+#define DEFAULT_PRIO 4
+#define CPUS_MAX 8   // ハートIDはこれより小さいこと
+#define LOCKS_MAX 16 // 統計を取るロックの数 (LOCK_STATS)
 
 #define SATP_SV32 (1u << 31)
+#define SATP_ASID_SHIFT 22
+#define SATP_ASID_MASK 0x1ff
+#define MEGAPAGE_SIZE (4 * 1024 * 1024)
 #define PAGE_V (1 << 0)
 #define PAGE_R (1 << 1)
 #define PAGE_W (1 << 2)
 #define PAGE_X (1 << 3)
 #define PAGE_U (1 << 4)
+#define PAGE_G (1 << 5) // 全アドレス空間で共通 (ASIDを切り替えてもTLBに残る)
+#define PAGE_A (1 << 6)
+#define PAGE_D (1 << 7)
+#define PAGE_COW (1 << 8) // RSWビット: コピーオンライトで共有中
+#define PTE_FLAGS 0x3FF
 #define SSTATUS_SPIE (1 << 5)
 #define SSTATUS_SUM (1 << 18)
 
+#define MAX_ORDER 10 // バディアロケータの最大オーダー (4MB)
+#define PG_FREE (1 << 0)
+#define PG_SLAB (1 << 1)
+#define PG_LARGE (1 << 2)
+#define PG_DIRTY (1 << 3) // ページキャッシュ: 書き戻しが必要
+#define PG_CACHE (1 << 4) // ファイルのページキャッシュが所有している
+
+#define KMALLOC_MIN_SHIFT 4
+#define KMALLOC_MIN_SIZE (1 << KMALLOC_MIN_SHIFT) // 16バイト
+#define KMALLOC_CLASSES 8                           // 16 ~ 2048バイト
+#define KMALLOC_MAX_SIZE (KMALLOC_MIN_SIZE << (KMALLOC_CLASSES - 1))
+#define SLAB_MIN_OBJS 8 // 1スラブあたりの最小オブジェクト数
+
 #define USER_BASE 0x1000000
+#define KSTACK_BASE 0xffc00000 // カーネルスタック領域 (4MB, 全プロセスで共有)
+#define KSTACK_PAGES 2
+#define KSTACK_SIZE (KSTACK_PAGES * PAGE_SIZE)
+#define KSTACK_SLOT_SIZE (KSTACK_SIZE + PAGE_SIZE) // 下にガードページ
+#define KSTACK_RESERVED 16 // スタックの最上部にCPUへのポインタを置く
 #define SCAUSE_ECALL 8
-#define FILES_MAX 10
-#define DISK_MAX_SIZE align_up(sizeof(struct file) * FILES_MAX, PAGE_SIZE)
+#define SCAUSE_INST_PAGE_FAULT 12
+#define SCAUSE_LOAD_PAGE_FAULT 13
+#define SCAUSE_STORE_PAGE_FAULT 15
+#define FS_HASH_SIZE 64    // 2のべき乗
+#define FDS_MAX 16         // プロセスあたりのファイルディスクリプタ数
+#define VMAS_MAX 8         // プロセスあたりのマッピング数
+#define VM_SHARED (1 << 0) // 書き込みをファイルと共有する (mmap)
+#define MMAP_BASE 0x40000000
+#define USER_STACK_TOP MMAP_BASE // execしたプログラムのスタック
+#define USER_STACK_SIZE (64 * 1024)
+#define MMAP_END 0x80000000 // ここから上はカーネル
 
 // VIRTIO
 #define SECTOR_SIZE 512
@@ -37,6 +77,8 @@
 #define VIRTIO_REG_QUEUE_PFN 0x40
 #define VIRTIO_REG_QUEUE_READY 0x44
 #define VIRTIO_REG_QUEUE_NOTIFY 0x50
+#define VIRTIO_REG_INTERRUPT_STATUS 0x60
+#define VIRTIO_REG_INTERRUPT_ACK 0x64
 #define VIRTIO_REG_DEVICE_STATUS 0x70
 #define VIRTIO_REG_DEVICE_CONFIG 0x100
 
@@ -58,13 +100,41 @@
 #define VIRTIO_GPU_IRQ 2
 #define VIRTIO_KEYBOARD_IRQ 3
 #define VIRTIO_MOUSE_IRQ 4
+#define UART_IRQ 10
+#define GPU_REQ_MAX 256 // virtio-gpuの要求の最大サイズ
+
+// UART (16550互換)
+#define UART_BASE 0x10000000
+#define UART_RBR 0 // 受信バッファ
+#define UART_IER 1 // 割り込み許可
+#define UART_LSR 5 // ラインステータス
+#define UART_IER_RX (1 << 0)
+#define UART_LSR_DR (1 << 0)     // 受信データあり
+#define UART_QUEUE_SIZE 64      // 2のべき乗
+#define KEYBOARD_QUEUE_SIZE 256 // 2のべき乗
 
 #define SCAUSE_INTERRUPT 0x80000000
+#define SCAUSE_SOFTWARE_INTERRUPT (SCAUSE_INTERRUPT | 1)
 #define SCAUSE_TIMER_INTERRUPT (SCAUSE_INTERRUPT | 5)
 #define SCAUSE_EXTERNAL_INTERRUPT (SCAUSE_INTERRUPT | 9)
 
+#define TIMER_FREQ 10000000           // QEMU virtのtimebase (10MHz)
+#define TIME_SLICE (TIMER_FREQ / 100) // 10ms (DEFAULT_PRIOの場合)
+
 #define SSTATUS_SIE (1 << 1)
+#define SSTATUS_SPP (1 << 8)
+#define SIE_SSIE (1 << 1)
+#define SIE_STIE (1 << 5)
 #define SIE_SEIE (1 << 9)
+#define SIP_SSIP (1 << 1)
+
+// SBI
+#define SBI_EXT_IPI 0x735049
+#define SBI_EXT_RFENCE 0x52464e43
+#define SBI_EXT_HSM 0x48534d
+#define SBI_HSM_HART_START 0
+#define SBI_HSM_HART_STATUS 2
+#define SBI_HSM_STOPPED 1
 #define VIRTIO_STATUS_ACK 1
 #define VIRTIO_STATUS_DRIVER 2
 #define VIRTIO_STATUS_DRIVER_OK 4
@@ -73,6 +143,7 @@
 #define VIRTQ_AVAIL_F_NO_INTERRUPT 1
 #define VIRTIO_BLK_T_IN 0
 #define VIRTIO_BLK_T_OUT 1
+#define BLK_MAX_SEGS (VIRTQ_ENTRY_NUM - 2) // ヘッダとステータスの分を除く
 
 // マクロ
 #define PANIC(fmt, ...)                                                        \
@@ -100,20 +171,137 @@ struct sbiret {
   long value;
 };
 
+// 実行中のプロセスは別のハートへ移ることがあるので、毎回tpから読む
+static inline struct cpu *this_cpu(void) {
+  struct cpu *cpu;
+  __asm__ __volatile__("mv %0, tp" : "=r"(cpu));
+  return cpu;
+}
+
+#define current_proc (this_cpu()->current)
+#define idle_proc (this_cpu()->idle)
+#define need_resched (this_cpu()->resched)
+
 struct trap_frame {
   uint32_t ra, gp, tp, t0, t1, t2, t3, t4, t5, t6;
   uint32_t a0, a1, a2, a3, a4, a5, a6, a7;
   uint32_t s0, s1, s2, s3, s4, s5, s6, s7, s8, s9, s10, s11;
   uint32_t sp;
+  uint32_t sepc; // 別のプロセスに切り替わっても失われないようにここに保存する
 } __attribute__((packed));
 
+// オープン中のファイル (ファイルディスクリプタ)
+struct open_file {
+  struct file *file; // NULLなら未使用
+  uint32_t pos;
+  int flags;
+};
+
+// ファイルやゼロ埋めのメモリをマッピングした仮想アドレスの範囲
+struct vm_area {
+  vaddr_t start; // 0なら未使用
+  vaddr_t end;
+  struct file *file; // NULLならゼロ埋めの匿名メモリ
+  uint32_t offset;   // ファイル内のオフセット (ページ境界)
+  uint32_t filesz;   // startからこのバイト数だけファイルの内容、残りはゼロ
+  int prot;
+  int flags;
+};
+
+struct wait_queue {
+  struct process *head;
+};
+
 struct process {
   int pid;
   int state;
   vaddr_t sp;
   uint32_t *page_table;
-  uint8_t stack[8192];
-  uintptr_t brk; // ユーザーヒープの末尾
+  uint32_t asid;        // 0ならカーネル (アイドル) かASIDなし
+  uint32_t asid_gen;    // asidを割り当てた世代
+  struct cpu *cpu;      // 最後に実行したCPU
+  vaddr_t kstack_top;   // カーネルスタックの末尾 (仮想アドレス)
+  paddr_t kstack_paddr; // カーネルスタックの物理ページ
+  uintptr_t heap_start;      // ユーザーヒープの先頭
+  uintptr_t brk;             // ユーザーヒープの末尾
+  struct process *wait_next; // 待ちキュー・sleep_listのリンク
+  uint64_t wakeup_time;      // sleep中の起床時刻
+  int prio;                  // 優先度 (0が最高)
+  uint32_t slice_left;       // 残りのタイムスライス (タイマーのtick)
+  struct process *run_next;  // 実行キューのリンク
+  struct open_file fds[FDS_MAX];
+  struct vm_area vmas[VMAS_MAX];
+  vaddr_t mmap_top; // 次にmmapで割り当てるアドレス
+
+  // 親プロセス (NULLなら終了しても誰もwaitしない) と子の終了待ち
+  struct process *parent;
+  struct wait_queue child_wq;
+};
+
+// 優先度ごとのFIFOと、空でないキューを示すビットマップ
+struct run_queue {
+  struct process *head[NR_PRIO];
+  struct process *tail[NR_PRIO];
+  uint32_t bitmap;
+  int nr_running; // キューに入っている (実行中でない) プロセス数
+};
+
+// 生産者と消費者が1つずつのロックなしリングバッファ (ring.c)
+struct ring {
+  uint32_t head; // 次に書き込む位置 (生産者だけが更新する)
+  uint32_t tail; // 次に読み出す位置 (消費者だけが更新する)
+  uint32_t mask; // 要素数 - 1
+  uint32_t elem_size;
+  uint8_t *buf;
+};
+
+struct spinlock {
+  volatile uint32_t locked;
+  struct cpu *owner; // 保持しているハート (二重取得の検出用)
+  const char *name;
+#ifdef LOCK_STATS
+  uint32_t acquired;    // 取得回数
+  uint32_t contended;   // 待たされた回数
+  uint64_t wait_ticks;  // 待った時間の合計
+  uint64_t hold_ticks;  // 保持した時間の合計
+  uint64_t max_hold;    // 最も長く保持した時間
+  uint64_t acquired_at; // 今回取得した時刻
+#endif
+};
+
+// ハートごとの状態 (tpレジスタが指す)
+struct cpu {
+  int id;      // ハートID
+  bool online; // アイドルループに入り、プロセスを受け取れる
+  struct process *current;
+  struct process *idle;
+  struct run_queue run_queue;
+  bool resched;         // トラップから戻る前にyieldする
+  uint64_t slice_start; // 現在のプロセスが実行を始めた時刻
+  uint64_t timer_next;  // 設定した時刻 (-1なら停止中、0なら必ず設定し直す)
+  uint32_t asid_gen;    // このハートのTLBが属するASIDの世代
+  int irq_depth;        // irq_saveの入れ子の深さ
+  bool irq_enabled;     // 一番外側のirq_saveの前に割り込みが有効だったか
+};
+
+struct page {
+  struct page *next; // 空きリスト / スラブの部分リスト
+  struct page *prev;
+  uint8_t order;
+  uint8_t flags;
+  uint16_t inuse; // スラブ: 使用中オブジェクト数, PG_LARGE: ページ数
+  uint16_t refcount; // ユーザー空間からのマッピング数
+  struct kmem_cache *cache;
+  struct page *head; // スラブの先頭ページ
+  void *freelist;
+};
+
+struct kmem_cache {
+  const char *name;
+  size_t size;
+  uint32_t slab_pages;
+  uint32_t objs_per_slab;
+  struct page *partial; // 空きオブジェクトのあるスラブ
 };
 
 struct virtq_desc {
@@ -148,16 +336,49 @@ struct virtio_virtq {
   volatile uint16_t *used_index;
   uint16_t last_used_index;
   uint32_t reg_base;
+  // ディスクリプタとリングの操作を守る (AMOを使うので4バイト境界に置く)
+  struct spinlock lock __attribute__((aligned(4)));
 } __attribute__((packed));
 
+_Static_assert(offsetof(struct virtio_virtq, lock) % 4 == 0,
+               "virtq lock must be 4-byte aligned");
+
 struct virtio_blk_req {
   uint32_t type;
   uint32_t reserved;
   uint64_t sector;
-  uint8_t data[512];
-  uint8_t status;
 } __attribute__((packed));
 
+// 発行中のディスク要求 (データはiovecで渡されたバッファへ直接DMAする)
+struct blk_request {
+  struct virtio_blk_req hdr;
+  uint8_t status;
+  volatile bool done;
+  struct wait_queue wq;
+};
+
+struct iovec {
+  void *base;
+  size_t len; // SECTOR_SIZEの倍数
+};
+
+// バッファキャッシュ
+#define BIO_NBUF 64
+#define BIO_HASH_SIZE 32 // 2のべき乗
+#define BUF_VALID (1 << 0)
+#define BUF_DIRTY (1 << 1)
+#define BUF_BUSY (1 << 2) // デバイスとのI/O中
+
+struct buf {
+  unsigned sector;
+  int flags;
+  int refcnt;
+  struct buf *hash_next;
+  struct buf *lru_prev;
+  struct buf *lru_next;
+  uint8_t data[SECTOR_SIZE];
+};
+
 // VIRTIO-GPU
 #define VIRTIO_GPU_EVENT_DISPLAY (1 << 0)
 
@@ -270,22 +491,69 @@ struct tar_header {
   char data[];
 } __attribute__((packed));
 
+// ELF
+#define ELFCLASS32 1
+#define EM_RISCV 243
+#define ET_EXEC 2
+#define PT_LOAD 1
+#define PF_X (1 << 0)
+#define PF_W (1 << 1)
+#define PF_R (1 << 2)
+
+struct elf32_ehdr {
+  uint8_t e_ident[16];
+  uint16_t e_type;
+  uint16_t e_machine;
+  uint32_t e_version;
+  uint32_t e_entry;
+  uint32_t e_phoff;
+  uint32_t e_shoff;
+  uint32_t e_flags;
+  uint16_t e_ehsize;
+  uint16_t e_phentsize;
+  uint16_t e_phnum;
+  uint16_t e_shentsize;
+  uint16_t e_shnum;
+  uint16_t e_shstrndx;
+} __attribute__((packed));
+
+struct elf32_phdr {
+  uint32_t p_type;
+  uint32_t p_offset;
+  uint32_t p_vaddr;
+  uint32_t p_paddr;
+  uint32_t p_filesz;
+  uint32_t p_memsz;
+  uint32_t p_flags;
+  uint32_t p_align;
+} __attribute__((packed));
+
+// ディスク上の連続した領域 (tarではヘッダの直後に1つ)
+struct extent {
+  unsigned start; // 先頭セクタ
+  unsigned len;   // セクタ数
+};
+
 struct file {
-  bool in_use;
   char name[100];
-  char data[1024];
   size_t size;
+  unsigned sector;      // ヘッダのセクタ
+  struct extent extent; // データの領域
+  bool dirty;           // ヘッダの書き戻しが必要か
+  paddr_t *pages;       // ページキャッシュ (未読み込みのページは0)
+  uint32_t page_cap;
+  struct file *hash_next;
+  struct file *next;
 };
 
-extern struct process procs[PROCS_MAX];
-extern struct process *current_proc;
-extern struct process *idle_proc;
+extern struct process **procs;
+extern int procs_cap;
+extern struct cpu cpus[CPUS_MAX];
 extern char __bss[], __bss_end[], __stack_top[];
 extern char __free_ram[], __free_ram_end[];
 extern char __kernel_base[];
 extern char _binary_shell_bin_start[], _binary_shell_bin_size[];
-extern struct file files[FILES_MAX];
-extern uint8_t disk[DISK_MAX_SIZE];
+extern struct file *fs_files;
 extern uint32_t screen_w;
 extern uint32_t screen_h;
 extern uint32_t *framebuffer;
@@ -295,16 +563,87 @@ extern int mouse_x;
 extern int mouse_y;
 
 // alloc.c
+void page_alloc_init(void);
 paddr_t alloc_pages(uint32_t n);
+paddr_t try_alloc_pages(uint32_t n);
+void free_pages(paddr_t paddr, uint32_t n);
+struct page *paddr_to_page(paddr_t paddr);
+paddr_t page_to_paddr(struct page *page);
+void free_page_table(uint32_t *table1);
+uint32_t *walk_pte(uint32_t *table1, uint32_t vaddr);
+void unmap_page(uint32_t *table1, uint32_t vaddr);
+void put_page(paddr_t paddr);
+extern uint32_t nr_free_pages;
 void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags);
+bool try_map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr,
+                  uint32_t flags);
+void map_megapage(uint32_t *table1, uint32_t vaddr, paddr_t paddr,
+                  uint32_t flags);
+void kernel_page_table_init(void);
+extern uint32_t *kernel_page_table;
+uint32_t *create_page_table(void);
+void asid_init(void);
+void switch_page_table(struct process *proc);
+void flush_tlb_all(void);
+void flush_tlb_asid(uint32_t asid);
+void flush_tlb_page(vaddr_t vaddr, uint32_t asid);
+void flush_tlb_kernel_range(vaddr_t start, size_t size);
+void heap_init(void);
 void *kmalloc(size_t size);
 void kfree(void *ptr);
+struct kmem_cache *kmem_cache_create(const char *name, size_t size);
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *ptr);
 
 // proc.c
 struct process *create_process(const void *image, size_t image_size);
+struct process *fork_process(struct trap_frame *f);
+void fork_return(void);
 void yield(void);
 void switch_context(uint32_t *prev_sp, uint32_t *next_sp);
 void user_entry(void);
+void sleep_on(struct wait_queue *wq);
+void wake_up(struct wait_queue *wq);
+void sched_enqueue(struct process *proc);
+void exit_process(void);
+int wait_child(void);
+uint32_t prio_slice(int prio);
+bool can_sleep(void);
+__attribute__((noreturn)) void cpu_idle(void);
+
+// spinlock.c
+void spin_init(struct spinlock *lock, const char *name);
+void spin_lock(struct spinlock *lock);
+void spin_unlock(struct spinlock *lock);
+void spin_lock_irqsave(struct spinlock *lock);
+void spin_unlock_irqrestore(struct spinlock *lock);
+void irq_save(void);
+void irq_restore(void);
+void lock_stats_dump(void);
+
+// smp.c
+extern struct spinlock big_kernel_lock;
+void kernel_lock(void);
+void kernel_unlock(void);
+void cpu_init(uint32_t hartid);
+void smp_init(void);
+void send_ipi(struct cpu *cpu);
+void handle_ipi(void);
+
+// vm.c
+vaddr_t vm_mmap(struct process *proc, struct file *file, uint32_t offset,
+                size_t len, int prot);
+int vm_munmap(struct process *proc, vaddr_t addr);
+int vm_msync(struct process *proc, vaddr_t addr);
+void vm_unmap_all(struct process *proc);
+bool vm_handle_fault(struct process *proc, vaddr_t addr, int access);
+bool vm_user_ok(struct process *proc, vaddr_t addr, size_t len, int access);
+bool vm_user_str_ok(struct process *proc, const char *str);
+int vm_sbrk(struct process *proc, int increment);
+uint32_t *vm_fork_page_table(uint32_t *parent);
+
+// exec.c
+int exec_process(struct trap_frame *f, const char *path);
 
 // trap.c
 void handle_trap(struct trap_frame *f);
@@ -316,19 +655,31 @@ struct sbiret sbi_call(long arg0, long arg1, long arg2, long arg3, long arg4,
 void plic_init(void);
 
 // virtio.c
-struct virtio_virtq *virtq_init(uint32_t base, unsigned index);
+struct virtio_virtq *virtq_init(uint32_t base, unsigned index,
+                                const char *name);
 uint32_t virtio_reg_read32(uint32_t base, unsigned offset);
 uint64_t virtio_reg_read64(uint32_t base, unsigned offset);
 void virtio_reg_write32(uint32_t base, unsigned offset, uint32_t value);
 void virtio_reg_fetch_and_or32(uint32_t base, unsigned offset, uint32_t value);
 void virtq_kick(struct virtio_virtq *virtq, int desc_index);
-bool virtq_is_busy(struct virtio_virtq *virtq);
 
 // virtio_blk.c
 void virtio_blk_init(void);
-void read_write_disk(void *buf, unsigned sector, int is_write);
+int blk_submit(unsigned sector, unsigned nsectors, const struct iovec *iov,
+               int iovcnt, int is_write);
+void handle_blk_interrupt(void);
 extern uint64_t blk_capacity;
 
+// bio.c
+void bio_init(void);
+struct buf *bget(unsigned sector);
+struct buf *bread(unsigned sector);
+void brelse(struct buf *b);
+void bdirty(struct buf *b);
+void bio_write(unsigned sector, const void *data);
+void bio_invalidate(unsigned sector, unsigned n);
+int bio_sync(void);
+
 // virtio_gpu.c
 void virtio_gpu_init(void);
 void virtio_gpu_send_req(void *req, int len);
@@ -345,12 +696,36 @@ void virtio_input_init(void);
 void handle_keyboard_interrupt(void);
 void handle_mouse_interrupt(void);
 long getchar(void);
+extern struct wait_queue input_wq;
 extern struct virtio_virtq *keyboard_vq;
 extern struct virtio_virtq *mouse_vq;
 
+// timer.c
+uint64_t read_time(void);
+void timer_update(void);
+void timer_switch(struct process *prev);
+void timer_sleep(uint64_t ticks);
+void handle_timer_interrupt(void);
+
+// ring.c
+void ring_init(struct ring *ring, void *buf, uint32_t size, uint32_t elem_size);
+bool ring_push(struct ring *ring, const void *elem);
+bool ring_pop(struct ring *ring, void *elem);
+
+// uart.c
+void uart_init(void);
+void handle_uart_interrupt(void);
+int uart_getc(void);
+
 // fs.c
 void fs_init(void);
 void fs_flush(void);
+paddr_t fs_get_page(struct file *file, uint32_t index);
+int fs_read(struct file *file, uint32_t off, void *buf, size_t len);
+int fs_write(struct file *file, uint32_t off, const void *buf, size_t len);
+void fs_truncate(struct file *file, size_t size);
+int fs_fsync(struct file *file);
+struct file *fs_create(const char *filename);
 struct file *fs_lookup(const char *filename);
 
 // console.c
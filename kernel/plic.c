@@ -5,11 +5,15 @@ void plic_init(void) {
     virtio_reg_write32(PLIC_PRIORITY(i), 0, 1);
   }
 
-  virtio_reg_write32(PLIC_SENABLE(0, 0), 0,
-                     (1 << VIRTIO_KEYBOARD_IRQ) | (1 << VIRTIO_MOUSE_IRQ));
+  // 外部割り込みはこのハート (ブートしたハート) だけで受ける
+  uint32_t hart = this_cpu()->id;
+  virtio_reg_write32(PLIC_SENABLE(hart, 0), 0,
+                     (1 << VIRTIO_BLK_IRQ) | (1 << VIRTIO_KEYBOARD_IRQ) |
+                         (1 << VIRTIO_MOUSE_IRQ) | (1 << UART_IRQ));
 
-  virtio_reg_write32(PLIC_SPRIORITY(0), 0, 0);
+  virtio_reg_write32(PLIC_SPRIORITY(hart), 0, 0);
 
+  // sstatus.SIEはアイドルループで有効にする
+  // (起動中はsscratchが未設定なので割り込みを受けられない)
   WRITE_CSR(sie, READ_CSR(sie) | SIE_SEIE);
-  WRITE_CSR(sstatus, READ_CSR(sstatus) | SSTATUS_SIE);
 }
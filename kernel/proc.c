@@ -1,34 +1,137 @@
 #include "common.h"
 #include "kernel.h"
 
-struct process procs[PROCS_MAX];
-struct process *current_proc;
-struct process *idle_proc;
+struct process **procs; // プロセス表 (pid - 1 で引く)
+int procs_cap;
+struct kmem_cache *proc_cache;
 
+// 新しいプロセスはyieldからカーネルロックを引き継いで始まる
+// (トラップの入口はsscratchからカーネルスタックを得るので、spは捨ててよい)
 __attribute__((naked)) void user_entry(void) {
   __asm__ __volatile__(
-      "csrw sepc, %[sepc]\n"
-      "csrw sstatus, %[sstatus]\n"
+      "call kernel_unlock\n"
+      "li t0, %[sepc]\n"
+      "csrw sepc, t0\n"
+      "li t0, %[sstatus]\n"
+      "csrw sstatus, t0\n"
+      "li sp, %[sp]\n"
       "sret\n"
       :
-      : [sepc] "r"(USER_BASE), [sstatus] "r"(SSTATUS_SPIE | SSTATUS_SUM));
+      : [sepc] "i"(USER_BASE), [sstatus] "i"(SSTATUS_SPIE | SSTATUS_SUM),
+        [sp] "i"(USER_STACK_TOP));
 }
 
-struct process *create_process(const void *image, size_t image_size) {
-  struct process *proc = NULL;
-  int i;
+// fork()した子プロセスはここからトラップフレームを復元してユーザーモードへ戻る
+__attribute__((naked)) void fork_return(void) {
+  __asm__ __volatile__("csrw sstatus, s0\n"
+                       "call kernel_unlock\n"
+                       "j trap_return\n");
+}
 
-  for (i = 0; i < PROCS_MAX; i++) {
-    if (procs[i].state == PROCS_UNUSED) {
-      proc = &procs[i];
-      break;
-    }
+// カーネルスタックはkstack領域のslot番目に置き、直下のページは空けておく
+static void kstack_alloc(struct process *proc, int slot) {
+  vaddr_t base = KSTACK_BASE + slot * KSTACK_SLOT_SIZE + PAGE_SIZE;
+  paddr_t paddr = alloc_pages(KSTACK_PAGES);
+  for (int i = 0; i < KSTACK_PAGES; i++) {
+    map_page(kernel_page_table, base + i * PAGE_SIZE, paddr + i * PAGE_SIZE,
+             PAGE_R | PAGE_W | PAGE_G);
+  }
+  flush_tlb_kernel_range(base, KSTACK_SIZE);
+
+  proc->kstack_paddr = paddr;
+  proc->kstack_top = base + KSTACK_SIZE - KSTACK_RESERVED;
+}
+
+// 起動中はページングが無効なので、初期フレームは物理アドレスで書き込む
+static uint32_t *kstack_phys_top(struct process *proc) {
+  return (uint32_t *)(proc->kstack_paddr + KSTACK_SIZE - KSTACK_RESERVED);
+}
+
+static vaddr_t kstack_vaddr(struct process *proc, uint32_t *p) {
+  return proc->kstack_top - ((uint32_t)kstack_phys_top(proc) - (uint32_t)p);
+}
+
+static void kstack_free(struct process *proc) {
+  vaddr_t base = proc->kstack_top + KSTACK_RESERVED - KSTACK_SIZE;
+  for (int i = 0; i < KSTACK_PAGES; i++)
+    *walk_pte(kernel_page_table, base + i * PAGE_SIZE) = 0;
+  flush_tlb_kernel_range(base, KSTACK_SIZE);
+  free_pages(proc->kstack_paddr, KSTACK_PAGES);
+}
+
+// トラップの入口でtpを復元できるよう、カーネルスタックの最上部にCPUを書いておく
+static void load_kstack(struct process *proc) {
+  *(struct cpu **)proc->kstack_top = this_cpu();
+  WRITE_CSR(sscratch, proc->kstack_top);
+}
+
+// 終了したプロセスの残りの資源を解放し、プロセス表の番号を空ける
+// (自分のカーネルスタックは解放できないので、他のプロセスから呼ぶ)
+static void free_process(struct process *proc) {
+  if (proc->page_table)
+    free_page_table(proc->page_table);
+  kstack_free(proc);
+  procs[proc->pid - 1] = NULL;
+  kmem_cache_free(proc_cache, proc);
+}
+
+// 親のいない終了済みプロセスは誰もwaitしないので、ここで回収する
+static void reap_orphans(void) {
+  for (int i = 0; i < procs_cap; i++) {
+    if (procs[i] && procs[i]->state == PROC_EXITED && !procs[i]->parent &&
+        procs[i] != current_proc)
+      free_process(procs[i]);
+  }
+}
+
+// 空いている番号がなければプロセス表を倍に広げる
+static int alloc_slot(void) {
+  reap_orphans();
+  for (int i = 0; i < procs_cap; i++) {
+    if (!procs[i])
+      return i;
   }
+  if (procs_cap == PROCS_MAX)
+    return -1;
+
+  int cap = procs_cap ? procs_cap * 2 : 8;
+  if (cap > PROCS_MAX)
+    cap = PROCS_MAX;
+
+  struct process **table = kmalloc(cap * sizeof(*table));
+  memset(table, 0, cap * sizeof(*table));
+  if (procs) {
+    memcpy(table, procs, procs_cap * sizeof(*table));
+    kfree(procs);
+  }
+  int slot = procs_cap;
+  procs = table;
+  procs_cap = cap;
+  return slot;
+}
+
+static struct process *alloc_process(void) {
+  int slot = alloc_slot();
+  if (slot < 0)
+    return NULL;
+
+  if (!proc_cache)
+    proc_cache = kmem_cache_create("process", sizeof(struct process));
+  struct process *proc = kmem_cache_alloc(proc_cache);
+  memset(proc, 0, sizeof(*proc));
+  proc->pid = slot + 1;
+  kstack_alloc(proc, slot);
+  procs[slot] = proc;
+  return proc;
+}
+
+struct process *create_process(const void *image, size_t image_size) {
+  struct process *proc = alloc_process();
   if (!proc) {
     PANIC("out of processes\n");
   }
 
-  uint32_t *sp = (uint32_t *)&proc->stack[sizeof(proc->stack)];
+  uint32_t *sp = kstack_phys_top(proc);
   *--sp = 0;                    // s11
   *--sp = 0;                    // s10
   *--sp = 0;                    // s9
@@ -43,26 +146,7 @@ struct process *create_process(const void *image, size_t image_size) {
   *--sp = 0;                    // s0
   *--sp = (uint32_t)user_entry; // ra
 
-  uint32_t *page_table = (uint32_t *)alloc_pages(1);
-
-  for (paddr_t paddr = (paddr_t)__kernel_base; paddr < (paddr_t)__free_ram_end;
-       paddr += PAGE_SIZE) {
-    map_page(page_table, paddr, paddr, PAGE_R | PAGE_W | PAGE_X);
-  }
-
-  // VIRTIOのMMIO領域をマッピング
-  for (paddr_t paddr = VIRTIO_BLK_PADDR; paddr < VIRTIO_BLK_PADDR + 0x8000;
-       paddr += PAGE_SIZE) {
-    map_page(page_table, paddr, paddr, PAGE_R | PAGE_W);
-  }
-
-  // PLICのMMIO領域をマッピング (0x0c000000 ~ 0x0c0400000, 4MB)
-  for (paddr_t paddr = PLIC_BASE; paddr < PLIC_BASE + 0x400000;
-       paddr += PAGE_SIZE) {
-    if (paddr >= 0x10000000) // 念のため
-      break;
-    map_page(page_table, paddr, paddr, PAGE_R | PAGE_W);
-  }
+  uint32_t *page_table = create_page_table();
 
   if (image) {
     for (uint32_t off = 0; off < image_size; off += PAGE_SIZE) {
@@ -77,42 +161,274 @@ struct process *create_process(const void *image, size_t image_size) {
   }
 
   // ユーザーヒープの開始地点を設定（プログラム末尾のページ境界）
-  proc->brk = USER_BASE + align_up(image_size, PAGE_SIZE);
+  proc->heap_start = USER_BASE + align_up(image_size, PAGE_SIZE);
+  proc->brk = proc->heap_start;
+  proc->mmap_top = MMAP_BASE;
+  memset(proc->vmas, 0, sizeof(proc->vmas));
 
-  proc->pid = i + 1;
-  proc->state = PROCS_RUNNABLE;
-  proc->sp = (uint32_t)sp;
+  // スタックはexecしたプログラムと同じくゼロ埋めの匿名メモリ
+  proc->vmas[0].start = USER_STACK_TOP - USER_STACK_SIZE;
+  proc->vmas[0].end = USER_STACK_TOP;
+  proc->vmas[0].prot = PROT_READ | PROT_WRITE;
+
+  proc->prio = DEFAULT_PRIO;
+  proc->slice_left = prio_slice(proc->prio);
+  proc->sp = kstack_vaddr(proc, sp);
   proc->page_table = page_table;
+
+  // アイドルプロセス (imageなし) は実行キューに入れない
+  proc->state = PROCS_RUNNABLE;
+  if (image)
+    sched_enqueue(proc);
   return proc;
 }
 
-void yield(void) {
-  struct process *next = idle_proc;
-  for (int i = 0; i < PROCS_MAX; i++) {
-    struct process *proc = &procs[(current_proc->pid + i) % PROCS_MAX];
-    if (proc->state == PROCS_RUNNABLE && proc->pid > 0) {
-      next = proc;
-      break;
-    }
+// 現在のプロセスを複製する。ユーザーページはコピーオンライトで共有する
+struct process *fork_process(struct trap_frame *f) {
+  struct process *proc = alloc_process();
+  if (!proc)
+    return NULL;
+
+  // 子プロセスはシステムコールの戻り値0でecallの次の命令から再開する
+  struct trap_frame *child_f = (struct trap_frame *)kstack_phys_top(proc) - 1;
+  *child_f = *f;
+  child_f->a0 = 0;
+
+  uint32_t *sp = kstack_phys_top(proc) - sizeof(*child_f) / sizeof(uint32_t);
+  for (int i = 0; i < 11; i++)
+    *--sp = 0;                        // s11 ~ s1
+  *--sp = SSTATUS_SPIE | SSTATUS_SUM; // s0: sstatus
+  *--sp = (uint32_t)fork_return;      // ra
+
+  proc->page_table = vm_fork_page_table(current_proc->page_table);
+  proc->heap_start = current_proc->heap_start;
+  proc->brk = current_proc->brk;
+  proc->mmap_top = current_proc->mmap_top;
+  memcpy(proc->vmas, current_proc->vmas, sizeof(proc->vmas));
+  memcpy(proc->fds, current_proc->fds, sizeof(proc->fds));
+
+  proc->parent = current_proc;
+  proc->prio = current_proc->prio;
+  proc->slice_left = prio_slice(proc->prio);
+  proc->sp = kstack_vaddr(proc, sp);
+  sched_enqueue(proc);
+  return proc;
+}
+
+// 優先度が高いほど長いタイムスライスを与える
+uint32_t prio_slice(int prio) {
+  return TIME_SLICE * (NR_PRIO - prio) / (NR_PRIO - DEFAULT_PRIO);
+}
+
+static void rq_push(struct run_queue *rq, struct process *proc) {
+  int prio = proc->prio;
+  proc->run_next = NULL;
+  if (rq->tail[prio])
+    rq->tail[prio]->run_next = proc;
+  else
+    rq->head[prio] = proc;
+  rq->tail[prio] = proc;
+  rq->bitmap |= 1 << prio;
+  rq->nr_running++;
+}
+
+// 最も優先度の高いキューの先頭を取り出す
+static struct process *rq_pop(struct run_queue *rq) {
+  if (!rq->bitmap)
+    return NULL;
+
+  int prio = __builtin_ctz(rq->bitmap);
+  struct process *proc = rq->head[prio];
+  rq->head[prio] = proc->run_next;
+  if (!rq->head[prio]) {
+    rq->tail[prio] = NULL;
+    rq->bitmap &= ~(1 << prio);
+  }
+  proc->run_next = NULL;
+  rq->nr_running--;
+  return proc;
+}
+
+// 自分のキューが空になったら、最も多く待たせている他のハートから1つもらう
+static struct process *rq_steal(void) {
+  struct cpu *busiest = NULL;
+  for (int i = 0; i < CPUS_MAX; i++) {
+    struct cpu *cpu = &cpus[i];
+    if (cpu->online && cpu->run_queue.nr_running > 0 &&
+        (!busiest ||
+         cpu->run_queue.nr_running > busiest->run_queue.nr_running))
+      busiest = cpu;
   }
-  if (next == current_proc) {
+  return busiest ? rq_pop(&busiest->run_queue) : NULL;
+}
+
+// 何もしていないハートがあればそちらに任せる
+static struct cpu *select_cpu(void) {
+  struct cpu *self = this_cpu();
+  if (self->current == self->idle)
+    return self;
+
+  for (int i = 0; i < CPUS_MAX; i++) {
+    struct cpu *cpu = &cpus[i];
+    if (cpu->online && cpu->current == cpu->idle &&
+        cpu->run_queue.nr_running == 0)
+      return cpu;
+  }
+  return self;
+}
+
+// プロセスを実行可能にして実行キューに入れる
+void sched_enqueue(struct process *proc) {
+  proc->state = PROCS_RUNNABLE;
+  struct cpu *cpu = select_cpu();
+  rq_push(&cpu->run_queue, proc);
+
+  if (cpu != this_cpu()) {
+    send_ipi(cpu); // アイドルループのwfiから起こす
+  } else if (current_proc && proc->prio < current_proc->prio) {
+    // 実行中のプロセスより優先度が高ければ横取りする
+    need_resched = true;
+  }
+  timer_update();
+}
+
+// カーネルロックを持った状態で呼ぶ。ロックは次に動くプロセスに引き継がれる
+void yield(void) {
+  struct cpu *cpu = this_cpu();
+  if (cpu->irq_depth)
+    PANIC("yield: called while holding a spinlock");
+
+  // 実行を続けられるプロセスは同じ優先度の末尾に並び直す
+  if (cpu->current->state == PROCS_RUNNABLE &&
+      cpu->current != cpu->idle)
+    rq_push(&cpu->run_queue, cpu->current);
+
+  struct process *next = rq_pop(&cpu->run_queue);
+  if (!next)
+    next = rq_steal();
+  if (!next)
+    next = cpu->idle;
+  cpu->resched = false;
+  if (next == cpu->current) {
     return;
   }
 
-  __asm__ __volatile__(
-      "sfence.vma\n"
-      "csrw satp, %[satp]\n"
-      "sfence.vma\n"
-      "csrw sscratch, %[sscratch]\n"
-      :
-      : [satp] "r"(SATP_SV32 | ((uint32_t)next->page_table / PAGE_SIZE)),
-        [sscratch] "r"((uint32_t)&next->stack[sizeof(next->stack)]));
+  switch_page_table(next);
+  load_kstack(next);
+
+  struct process *prev = cpu->current;
+  cpu->current = next;
+  timer_switch(prev);
+
+  // 終了したプロセスのメモリを回収する (satpは切り替え済み)
+  if (prev->state == PROC_EXITED && prev->page_table) {
+    free_page_table(prev->page_table);
+    prev->page_table = NULL;
+  }
 
-  struct process *prev = current_proc;
-  current_proc = next;
+  // sstatus (SPP/SPIE) はプロセスごとに保存する
+  uint32_t sstatus = READ_CSR(sstatus);
   switch_context(&prev->sp, &next->sp);
+  WRITE_CSR(sstatus, sstatus);
 }
 
+// このハートのアイドルプロセスとして動き始める
+void cpu_idle(void) {
+  struct cpu *cpu = this_cpu();
+  kernel_lock();
+  cpu->current = cpu->idle;
+  switch_page_table(cpu->idle);
+  load_kstack(cpu->idle);
+  cpu->online = true;
+  timer_update();
+  kernel_unlock();
+
+  WRITE_CSR(sie, READ_CSR(sie) | SIE_STIE | SIE_SSIE);
+
+  // 実行可能なプロセスがなければ割り込みを待つ
+  for (;;) {
+    WRITE_CSR(sstatus, READ_CSR(sstatus) & ~SSTATUS_SIE);
+    kernel_lock();
+    yield();
+    reap_orphans();
+    kernel_unlock();
+    __asm__ __volatile__("wfi");
+    WRITE_CSR(sstatus, READ_CSR(sstatus) | SSTATUS_SIE);
+  }
+}
+
+// 現在のプロセスを終了させる。資源は親のwaitで回収される
+// 親がいなければアイドルループかプロセスの生成時に回収される
+void exit_process(void) {
+  struct process *proc = current_proc;
+  for (int i = 0; i < procs_cap; i++) {
+    struct process *child = procs[i];
+    if (!child || child->parent != proc)
+      continue;
+
+    // 終了済みの子はもう動かないので、すぐにスタックごと解放する
+    if (child->state == PROC_EXITED)
+      free_process(child);
+    else
+      child->parent = NULL;
+  }
+
+  proc->state = PROC_EXITED;
+  if (proc->parent)
+    wake_up(&proc->parent->child_wq);
+  yield();
+  PANIC("unreachable");
+}
+
+// 終了した子プロセスを1つ回収してそのpidを返す。子がいなければ-1
+int wait_child(void) {
+  for (;;) {
+    bool has_child = false;
+    for (int i = 0; i < procs_cap; i++) {
+      struct process *child = procs[i];
+      if (!child || child->parent != current_proc)
+        continue;
+
+      has_child = true;
+      if (child->state == PROC_EXITED) {
+        int pid = child->pid;
+        free_process(child);
+        return pid;
+      }
+    }
+
+    if (!has_child)
+      return -1;
+    sleep_on(&current_proc->child_wq);
+  }
+}
+
+// 割り込みを禁止した状態 (トラップ処理中) で呼ぶこと
+void sleep_on(struct wait_queue *wq) {
+  current_proc->state = PROC_BLOCKED;
+  current_proc->wait_next = wq->head;
+  wq->head = current_proc;
+  yield();
+}
+
+void wake_up(struct wait_queue *wq) {
+  struct process *proc = wq->head;
+  if (!proc)
+    return;
+
+  while (proc) {
+    struct process *next = proc->wait_next;
+    proc->wait_next = NULL;
+    if (proc->state == PROC_BLOCKED)
+      sched_enqueue(proc);
+    proc = next;
+  }
+  wq->head = NULL;
+}
+
+// 起動中とアイドルプロセスはスリープできない
+bool can_sleep(void) { return current_proc && current_proc != idle_proc; }
+
 __attribute__((naked)) void switch_context(uint32_t *prev_sp,
                                            uint32_t *next_sp) {
   __asm__ __volatile__("addi sp, sp, -13 * 4\n"
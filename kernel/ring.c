@@ -0,0 +1,47 @@
+#include "common.h"
+#include "kernel.h"
+
+// 生産者と消費者が1つずつなら、ロックなしで使えるリングバッファ
+// headは生産者だけが、tailは消費者だけが書く (剰余を取らずに増やし続ける)
+void ring_init(struct ring *ring, void *buf, uint32_t size,
+               uint32_t elem_size) {
+  if (size == 0 || (size & (size - 1)) != 0)
+    PANIC("ring size %d is not a power of two", size);
+
+  ring->buf = buf;
+  ring->mask = size - 1;
+  ring->elem_size = elem_size;
+  ring->head = 0;
+  ring->tail = 0;
+}
+
+static void *ring_slot(struct ring *ring, uint32_t index) {
+  return ring->buf + (index & ring->mask) * ring->elem_size;
+}
+
+// 要素をコピーして入れる。満杯ならfalse
+bool ring_push(struct ring *ring, const void *elem) {
+  uint32_t head = ring->head;
+  // 消費者がスロットを読み終えるまでは上書きしない
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (head - tail > ring->mask)
+    return false;
+
+  memcpy(ring_slot(ring, head), elem, ring->elem_size);
+  // 中身を書き終えてから消費者に見せる
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+// 先頭の要素をelemにコピーして取り出す。空ならfalse
+bool ring_pop(struct ring *ring, void *elem) {
+  uint32_t tail = ring->tail;
+  uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  if (head == tail)
+    return false;
+
+  memcpy(elem, ring_slot(ring, tail), ring->elem_size);
+  // 読み終えてからスロットを生産者に返す
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
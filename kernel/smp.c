@@ -0,0 +1,75 @@
+#include "common.h"
+#include "kernel.h"
+
+struct cpu cpus[CPUS_MAX]; // ハートIDで引く
+
+// システムコールや割り込みの処理はこのロックで1つのハートずつ行う
+// (ユーザーモードのプログラムはすべてのハートで同時に動く)
+struct spinlock big_kernel_lock;
+
+// 割り込みを禁止した状態で呼ぶこと
+void kernel_lock(void) { spin_lock(&big_kernel_lock); }
+
+void kernel_unlock(void) { spin_unlock(&big_kernel_lock); }
+
+void cpu_init(uint32_t hartid) {
+  if (hartid >= CPUS_MAX)
+    PANIC("hart %d is not supported", hartid);
+
+  struct cpu *cpu = &cpus[hartid];
+  cpu->id = hartid;
+  __asm__ __volatile__("mv tp, %0" ::"r"(cpu));
+}
+
+// OpenSBIから起動されたハートはここから始まる (a0: ハートID, a1: スタック)
+__attribute__((naked)) void secondary_boot(void) {
+  __asm__ __volatile__("mv sp, a1\n"
+                       "j secondary_main\n");
+}
+
+void secondary_main(uint32_t hartid) {
+  cpu_init(hartid);
+  WRITE_CSR(stvec, (uint32_t)kernel_entry);
+
+  kernel_lock();
+  printf("hart %d started\n", hartid);
+  kernel_unlock();
+  cpu_idle();
+}
+
+// 停止しているハートごとにアイドルプロセスとスタックを用意して起動する
+void smp_init(void) {
+  kernel_lock();
+  for (int hartid = 0; hartid < CPUS_MAX; hartid++) {
+    if (hartid == this_cpu()->id)
+      continue;
+
+    // 存在しないハートはエラーになる
+    struct sbiret ret =
+        sbi_call(hartid, 0, 0, 0, 0, 0, SBI_HSM_HART_STATUS, SBI_EXT_HSM);
+    if (ret.error || ret.value != SBI_HSM_STOPPED)
+      continue;
+
+    struct cpu *cpu = &cpus[hartid];
+    cpu->idle = create_process(NULL, 0);
+    cpu->idle->pid = 0;
+
+    // アイドルループはこのスタックで動く (トラップはアイドルプロセスのスタック)
+    paddr_t stack = alloc_pages(KSTACK_PAGES);
+    ret = sbi_call(hartid, (uint32_t)secondary_boot, stack + KSTACK_SIZE, 0, 0,
+                   0, SBI_HSM_HART_START, SBI_EXT_HSM);
+    if (ret.error)
+      printf("failed to start hart %d: %d\n", hartid, ret.error);
+  }
+  kernel_unlock();
+}
+
+void send_ipi(struct cpu *cpu) {
+  sbi_call(1 << cpu->id, 0, 0, 0, 0, 0, 0, SBI_EXT_IPI);
+}
+
+// 他のハートが実行キューにプロセスを入れた
+void handle_ipi(void) {
+  WRITE_CSR(sip, READ_CSR(sip) & ~SIP_SSIP);
+  need_resched = true;
+}
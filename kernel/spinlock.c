@@ -0,0 +1,169 @@
+#include "common.h"
+#include "kernel.h"
+
+#ifdef LOCK_STATS
+struct spinlock *lock_list[LOCKS_MAX]; // lockstatで表示するロック
+int nr_locks;
+#endif
+
+void spin_init(struct spinlock *lock, const char *name) {
+  lock->locked = 0;
+  lock->owner = NULL;
+  lock->name = name;
+#ifdef LOCK_STATS
+  int i = __atomic_fetch_add(&nr_locks, 1, __ATOMIC_RELAXED);
+  if (i < LOCKS_MAX)
+    lock_list[i] = lock;
+#endif
+}
+
+// 取れればtrue。取れた場合はそれ以降の読み書きが前に出ない (aq)
+static bool lock_try(struct spinlock *lock) {
+  uint32_t old;
+  __asm__ __volatile__("amoswap.w.aq %0, %1, (%2)"
+                       : "=r"(old)
+                       : "r"(1), "r"(&lock->locked)
+                       : "memory");
+  return old == 0;
+}
+
+#ifdef LOCK_STATS
+static uint64_t lock_clock(void) { return read_time(); }
+
+// startは待ち始めた時刻 (待たずに取れた場合は0)
+static void lock_acquired(struct spinlock *lock, uint64_t start) {
+  lock->acquired_at = read_time();
+  lock->acquired++;
+  if (start) {
+    lock->contended++;
+    lock->wait_ticks += lock->acquired_at - start;
+  }
+}
+
+static void lock_released(struct spinlock *lock) {
+  uint64_t hold = read_time() - lock->acquired_at;
+  lock->hold_ticks += hold;
+  if (hold > lock->max_hold)
+    lock->max_hold = hold;
+}
+#else
+static uint64_t lock_clock(void) { return 0; }
+static void lock_acquired(struct spinlock *lock, uint64_t start) {
+  (void)lock;
+  (void)start;
+}
+static void lock_released(struct spinlock *lock) { (void)lock; }
+#endif
+
+// 割り込みハンドラと共有するロックはspin_lock_irqsaveで取ること
+void spin_lock(struct spinlock *lock) {
+  if (lock->owner == this_cpu())
+    PANIC("spin_lock: %s is already held by this hart", lock->name);
+
+  uint64_t start = 0;
+  if (!lock_try(lock)) {
+    start = lock_clock();
+    do {
+      // 解放されるまでは読むだけにして、キャッシュラインを奪い合わない
+      while (lock->locked)
+        ;
+    } while (!lock_try(lock));
+  }
+  lock_acquired(lock, start);
+  lock->owner = this_cpu();
+}
+
+void spin_unlock(struct spinlock *lock) {
+  if (lock->owner != this_cpu())
+    PANIC("spin_unlock: %s is not held by this hart", lock->name);
+
+  lock_released(lock);
+  lock->owner = NULL;
+  // それまでの読み書きが終わってから解放する (rl)
+  __asm__ __volatile__("amoswap.w.rl zero, zero, (%0)" ::"r"(&lock->locked)
+                       : "memory");
+}
+
+// 割り込みを禁止する。入れ子にでき、一番外側のirq_restoreで元に戻す
+void irq_save(void) {
+  bool enabled = READ_CSR(sstatus) & SSTATUS_SIE;
+  WRITE_CSR(sstatus, READ_CSR(sstatus) & ~SSTATUS_SIE);
+
+  struct cpu *cpu = this_cpu();
+  if (cpu->irq_depth++ == 0)
+    cpu->irq_enabled = enabled;
+}
+
+void irq_restore(void) {
+  struct cpu *cpu = this_cpu();
+  if (READ_CSR(sstatus) & SSTATUS_SIE)
+    PANIC("irq_restore: interrupts are enabled");
+  if (cpu->irq_depth == 0)
+    PANIC("irq_restore: not saved");
+
+  if (--cpu->irq_depth == 0 && cpu->irq_enabled)
+    WRITE_CSR(sstatus, READ_CSR(sstatus) | SSTATUS_SIE);
+}
+
+void spin_lock_irqsave(struct spinlock *lock) {
+  irq_save();
+  spin_lock(lock);
+}
+
+void spin_unlock_irqrestore(struct spinlock *lock) {
+  spin_unlock(lock);
+  irq_restore();
+}
+
+#ifdef LOCK_STATS
+#define LOCK_NAME_WIDTH 16
+#define LOCK_STAT_WIDTH 11
+
+// printfには幅の指定がないので、空白で埋めて列をそろえる
+static void print_padded(const char *s, int width, bool right) {
+  int pad = width - (int)strlen(s);
+  if (!right)
+    printf("%s", s);
+  for (int i = 0; i < pad; i++)
+    putchar(' ');
+  if (right)
+    printf("%s", s);
+}
+
+static void print_stat(uint32_t value) {
+  char buf[11];
+  int i = sizeof(buf) - 1;
+  buf[i] = '\0';
+  do {
+    buf[--i] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  print_padded(&buf[i], LOCK_STAT_WIDTH, true);
+}
+#endif
+
+// ロックごとの取得回数・競合回数と、待ち・保持時間 (マイクロ秒) を表示する
+void lock_stats_dump(void) {
+#ifdef LOCK_STATS
+  static const char *columns[] = {"ACQUIRED", "CONTENDED", "WAIT(us)",
+                                  "HOLD(us)", "MAX(us)"};
+  uint32_t ticks_per_us = TIMER_FREQ / 1000000;
+  print_padded("NAME", LOCK_NAME_WIDTH, false);
+  for (unsigned i = 0; i < sizeof(columns) / sizeof(columns[0]); i++)
+    print_padded(columns[i], LOCK_STAT_WIDTH, true);
+  printf("\n");
+
+  for (int i = 0; i < nr_locks && i < LOCKS_MAX; i++) {
+    struct spinlock *lock = lock_list[i];
+    print_padded(lock->name, LOCK_NAME_WIDTH, false);
+    print_stat(lock->acquired);
+    print_stat(lock->contended);
+    print_stat(lock->wait_ticks / ticks_per_us);
+    print_stat(lock->hold_ticks / ticks_per_us);
+    print_stat(lock->max_hold / ticks_per_us);
+    printf("\n");
+  }
+#else
+  printf("lock statistics are disabled (build with LOCK_STATS=1)\n");
+#endif
+}
@@ -0,0 +1,88 @@
+#include "common.h"
+#include "kernel.h"
+
+// 実行キューに待っているプロセスがなければタイマー割り込みを止め、
+// タイムスライスの終わりと最も早いsleepの期限だけをプログラムする
+// (タイマーはハートごとで、sleep_listはどのハートの割り込みでも処理する)
+struct process *sleep_list; // 起床時刻の早い順
+
+uint64_t read_time(void) {
+  uint32_t hi, lo;
+  do {
+    hi = READ_CSR(timeh);
+    lo = READ_CSR(time);
+  } while (hi != READ_CSR(timeh));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+static void sbi_set_timer(uint64_t when) {
+  sbi_call(when, when >> 32, 0, 0, 0, 0, 0, 0);
+}
+
+static uint64_t slice_deadline(struct cpu *cpu) {
+  return cpu->slice_start + cpu->current->slice_left;
+}
+
+// 次のイベントに合わせてタイマーを設定し直す
+void timer_update(void) {
+  struct cpu *cpu = this_cpu();
+  uint64_t next = 0;
+  if (cpu->run_queue.nr_running > 0 && cpu->current != cpu->idle)
+    next = slice_deadline(cpu);
+  if (sleep_list && (!next || sleep_list->wakeup_time < next))
+    next = sleep_list->wakeup_time;
+
+  // 止めるときは到達しない時刻を設定する
+  uint64_t when = next ? next : (uint64_t)-1;
+  if (when == cpu->timer_next)
+    return;
+  cpu->timer_next = when;
+  sbi_set_timer(when);
+}
+
+// 切り替え前のプロセスが使った時間をタイムスライスから差し引く
+void timer_switch(struct process *prev) {
+  struct cpu *cpu = this_cpu();
+  uint64_t now = read_time();
+  uint64_t used = now - cpu->slice_start;
+  if (used >= prev->slice_left)
+    prev->slice_left = prio_slice(prev->prio); // 使い切ったので補充する
+  else
+    prev->slice_left -= used;
+
+  cpu->slice_start = now;
+  timer_update();
+}
+
+void timer_sleep(uint64_t ticks) {
+  struct process *proc = current_proc;
+  proc->wakeup_time = read_time() + ticks;
+
+  struct process **p = &sleep_list;
+  while (*p && (*p)->wakeup_time <= proc->wakeup_time)
+    p = &(*p)->wait_next;
+  proc->wait_next = *p;
+  *p = proc;
+
+  proc->state = PROC_BLOCKED;
+  yield();
+}
+
+void handle_timer_interrupt(void) {
+  struct cpu *cpu = this_cpu();
+  uint64_t now = read_time();
+  cpu->timer_next = 0; // 設定済みの時刻は過ぎたので必ず設定し直す
+
+  while (sleep_list && sleep_list->wakeup_time <= now) {
+    struct process *proc = sleep_list;
+    sleep_list = proc->wait_next;
+    proc->wait_next = NULL;
+    sched_enqueue(proc);
+  }
+
+  // タイムスライスを使い切ったので同じ優先度の他のプロセスに譲る
+  if (cpu->current != cpu->idle && cpu->run_queue.nr_running > 0 &&
+      now >= slice_deadline(cpu))
+    yield();
+  timer_update();
+}
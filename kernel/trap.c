@@ -20,25 +20,57 @@ struct sbiret sbi_call(long arg0, long arg1, long arg2, long arg3, long arg4,
   return (struct sbiret){.error = a0, .value = a1};
 }
 
+static struct open_file *get_fd(int fd) {
+  if (fd < 0 || fd >= FDS_MAX || !current_proc->fds[fd].file)
+    return NULL;
+  return &current_proc->fds[fd];
+}
+
+static void close_fd(struct open_file *of) {
+  if ((of->flags & O_ACCMODE) != O_RDONLY)
+    fs_fsync(of->file);
+  of->file = NULL;
+}
+
+// 現在のプロセスを終了させる (戻らない)
+static void exit_current(void) {
+  vm_unmap_all(current_proc);
+  for (int i = 0; i < FDS_MAX; i++) {
+    if (current_proc->fds[i].file)
+      close_fd(&current_proc->fds[i]);
+  }
+  printf("process %d exited\n", current_proc->pid);
+  exit_process();
+}
+
 void handle_syscall(struct trap_frame *f) {
   switch (f->a3) {
   case SYS_PUTCHAR:
     putchar(f->a0);
     break;
-  case SYS_GETCHAR:
-    f->a0 = getchar();
+  case SYS_GETCHAR: {
+    // 入力があるまでスリープする (割り込み禁止中なので起床を取りこぼさない)
+    long ch;
+    while ((ch = getchar()) < 0)
+      sleep_on(&input_wq);
+    f->a0 = ch;
     break;
+  }
   case SYS_EXIT:
-    printf("process %d exited\n", current_proc->pid);
-    current_proc->state = PROC_EXITED;
-    yield();
-    PANIC("unreachable");
+    exit_current();
     break;
   case SYS_READFILE:
   case SYS_WRITEFILE: {
     const char *filename = (const char *)f->a0;
     char *buf = (char *)f->a1;
     int len = f->a2;
+    int access = f->a3 == SYS_WRITEFILE ? PROT_READ : PROT_WRITE;
+    if (!vm_user_str_ok(current_proc, filename) ||
+        !vm_user_ok(current_proc, (vaddr_t)buf, len, access)) {
+      f->a0 = -1;
+      break;
+    }
+
     struct file *file = fs_lookup(filename);
     if (!file) {
       printf("file not found: %s\n", filename);
@@ -46,120 +78,286 @@ void handle_syscall(struct trap_frame *f) {
       break;
     }
 
-    if (len > (int)sizeof(file->data))
-      len = file->size;
-
     if (f->a3 == SYS_WRITEFILE) {
-      memcpy(file->data, buf, len);
-      file->size = len;
+      fs_truncate(file, 0);
+      fs_write(file, 0, buf, len);
       fs_flush();
     } else {
-      memcpy(buf, file->data, len);
+      len = fs_read(file, 0, buf, len);
     }
 
     f->a0 = len;
     break;
   }
+  case SYS_OPEN: {
+    const char *filename = (const char *)f->a0;
+    int flags = f->a1;
+    if (!vm_user_str_ok(current_proc, filename)) {
+      f->a0 = -1;
+      break;
+    }
+
+    int fd = 0;
+    while (fd < FDS_MAX && current_proc->fds[fd].file)
+      fd++;
+    if (fd == FDS_MAX) {
+      f->a0 = -1;
+      break;
+    }
+
+    struct file *file = fs_lookup(filename);
+    if (!file && (flags & O_CREAT))
+      file = fs_create(filename);
+    if (!file) {
+      f->a0 = -1;
+      break;
+    }
+
+    if ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY)
+      fs_truncate(file, 0);
+
+    current_proc->fds[fd].file = file;
+    current_proc->fds[fd].pos = 0;
+    current_proc->fds[fd].flags = flags;
+    f->a0 = fd;
+    break;
+  }
+  case SYS_READ:
+  case SYS_WRITE: {
+    struct open_file *of = get_fd(f->a0);
+    int mode = of ? of->flags & O_ACCMODE : -1;
+    int access = f->a3 == SYS_READ ? PROT_WRITE : PROT_READ;
+    if (!of || (f->a3 == SYS_READ && mode == O_WRONLY) ||
+        (f->a3 == SYS_WRITE && mode == O_RDONLY) ||
+        !vm_user_ok(current_proc, f->a1, f->a2, access)) {
+      f->a0 = -1;
+      break;
+    }
+
+    // 書き込みはページキャッシュに残し、closeの時に書き戻す
+    int n;
+    if (f->a3 == SYS_READ)
+      n = fs_read(of->file, of->pos, (void *)f->a1, f->a2);
+    else
+      n = fs_write(of->file, of->pos, (const void *)f->a1, f->a2);
+
+    if (n > 0)
+      of->pos += n;
+    f->a0 = n;
+    break;
+  }
+  case SYS_LSEEK: {
+    struct open_file *of = get_fd(f->a0);
+    if (!of) {
+      f->a0 = -1;
+      break;
+    }
+
+    int offset = f->a1;
+    int base = 0;
+    if (f->a2 == SEEK_CUR)
+      base = of->pos;
+    else if (f->a2 == SEEK_END)
+      base = of->file->size;
+    else if (f->a2 != SEEK_SET) {
+      f->a0 = -1;
+      break;
+    }
+
+    if (base + offset < 0) {
+      f->a0 = -1;
+      break;
+    }
+
+    of->pos = base + offset;
+    f->a0 = of->pos;
+    break;
+  }
+  case SYS_CLOSE: {
+    struct open_file *of = get_fd(f->a0);
+    if (!of) {
+      f->a0 = -1;
+      break;
+    }
+
+    close_fd(of);
+    f->a0 = 0;
+    break;
+  }
+  case SYS_SLEEP:
+    timer_sleep((uint64_t)f->a0 * (TIMER_FREQ / 1000));
+    f->a0 = 0;
+    break;
+  case SYS_WAIT:
+    f->a0 = wait_child();
+    break;
+  case SYS_FORK: {
+    struct process *child = fork_process(f);
+    f->a0 = child ? child->pid : -1;
+    break;
+  }
+  case SYS_EXEC: {
+    // 古いアドレス空間は捨てられるので、パスはカーネルにコピーしておく
+    char path[sizeof(((struct file *)0)->name)];
+    const char *user_path = (const char *)f->a0;
+    if (!vm_user_str_ok(current_proc, user_path) ||
+        strlen(user_path) >= sizeof(path)) {
+      f->a0 = -1;
+      break;
+    }
+
+    strcpy(path, user_path);
+    // 成功した場合はトラップフレームごと置き換わる
+    if (exec_process(f, path) < 0)
+      f->a0 = -1;
+    break;
+  }
+  case SYS_MMAP: {
+    struct open_file *of = get_fd(f->a0);
+    int prot = f->a4;
+    int mode = of ? of->flags & O_ACCMODE : -1;
+    // 読めないファイルはマッピングできず、書き込みにはO_RDWRが必要
+    if (!of || mode == O_WRONLY || ((prot & PROT_WRITE) && mode != O_RDWR)) {
+      f->a0 = -1;
+      break;
+    }
+
+    f->a0 = vm_mmap(current_proc, of->file, f->a1, f->a2, prot);
+    break;
+  }
+  case SYS_MUNMAP:
+    f->a0 = vm_munmap(current_proc, f->a0);
+    break;
+  case SYS_MSYNC:
+    f->a0 = vm_msync(current_proc, f->a0);
+    break;
   case SYS_LS: {
-    for (int i = 0; i < FILES_MAX; i++) {
-      if (files[i].in_use) {
-        const char *name = files[i].name;
-        if (strcmp(name, ".") == 0)
-          continue;
-        if (name[0] == '.' && name[1] == '/')
-          name += 2;
-        printf("%s  ", name);
-      }
+    for (struct file *file = fs_files; file; file = file->next) {
+      const char *name = file->name;
+      if (strcmp(name, ".") == 0)
+        continue;
+      if (name[0] == '.' && name[1] == '/')
+        name += 2;
+      printf("%s  ", name);
     }
     printf("\n");
     break;
   }
   case SYS_PS: {
-    printf("PID  STATE\n");
-    for (int i = 0; i < PROCS_MAX; i++) {
-      struct process *proc = &procs[i];
-      if (proc->state == PROCS_UNUSED)
+    printf("PID  PRIO  STATE\n");
+    for (int i = 0; i < procs_cap; i++) {
+      struct process *proc = procs[i];
+      if (!proc || proc->state == PROCS_UNUSED)
         continue;
 
       const char *state = "UNKNOWN";
       if (proc->state == PROCS_RUNNABLE)
         state = "RUNNABLE";
+      else if (proc->state == PROC_BLOCKED)
+        state = "BLOCKED";
       else if (proc->state == PROC_EXITED)
         state = "EXITED";
 
-      printf("%d    %s\n", proc->pid, state);
+      printf("%d    %d     %s\n", proc->pid, proc->prio, state);
     }
     break;
   }
-  case SYS_SBRK: {
-    int increment = f->a0;
-    uintptr_t old_brk = current_proc->brk;
-    uintptr_t new_brk = old_brk + increment;
-
-    if (increment == 0) {
-      f->a0 = old_brk;
+  case SYS_SETPRIO: {
+    int prio = f->a0;
+    if (prio < 0 || prio >= NR_PRIO) {
+      f->a0 = -1;
       break;
     }
 
-    // 新しいページを割り当ててマッピング
-    uintptr_t start_page = align_up(old_brk, PAGE_SIZE);
-    uintptr_t end_page = align_up(new_brk, PAGE_SIZE);
-
-    for (uintptr_t addr = start_page; addr < end_page; addr += PAGE_SIZE) {
-      paddr_t page = alloc_pages(1);
-      map_page(current_proc->page_table, addr, page, PAGE_U | PAGE_R | PAGE_W);
-    }
-
-    current_proc->brk = new_brk;
-    f->a0 = old_brk;
+    // 次に実行キューに並ぶ時から新しい優先度が使われる
+    current_proc->prio = prio;
+    need_resched = true;
+    f->a0 = 0;
     break;
   }
+  case SYS_LOCKSTAT:
+    lock_stats_dump();
+    break;
+  case SYS_SBRK:
+    f->a0 = vm_sbrk(current_proc, f->a0);
+    break;
   default:
-    PANIC("unexpected syscall a3=%x\n", f->a3);
+    // 不明なシステムコールはカーネルを止めずにエラーを返す
+    printf("unexpected syscall a3=%x\n", f->a3);
+    f->a0 = -1;
+    break;
   }
 }
 
+// ユーザーモードの例外はそのプロセスだけを終了させる
+static void user_fault(uint32_t scause, uint32_t stval, uint32_t sepc) {
+  if (READ_CSR(sstatus) & SSTATUS_SPP)
+    PANIC("unexpected trap scause=%x, stval=%x, sepc=%x\n", scause, stval,
+          sepc);
+
+  printf("process %d killed: scause=%x, stval=%x, sepc=%x\n",
+         current_proc->pid, scause, stval, sepc);
+  exit_current();
+}
+
+// カーネルロックを取ってから処理し、ユーザーモードへ戻る前に手放す
 void handle_trap(struct trap_frame *f) {
   uint32_t scause = READ_CSR(scause);
   uint32_t stval = READ_CSR(stval);
-  uint32_t user_pc = READ_CSR(sepc);
+  kernel_lock();
 
   if (scause == SCAUSE_ECALL) {
+    // execは戻り先を書き換えるので先に進めておく
+    f->sepc += 4;
     handle_syscall(f);
-    user_pc += 4;
+  } else if (scause == SCAUSE_INST_PAGE_FAULT ||
+             scause == SCAUSE_LOAD_PAGE_FAULT ||
+             scause == SCAUSE_STORE_PAGE_FAULT) {
+    int access = PROT_READ;
+    if (scause == SCAUSE_INST_PAGE_FAULT)
+      access = PROT_EXEC;
+    else if (scause == SCAUSE_STORE_PAGE_FAULT)
+      access = PROT_WRITE;
+
+    // 処理できれば同じ命令から再実行する
+    if ((READ_CSR(sstatus) & SSTATUS_SPP) ||
+        !vm_handle_fault(current_proc, stval, access))
+      user_fault(scause, stval, f->sepc);
   } else if (scause == SCAUSE_EXTERNAL_INTERRUPT) {
     // S-mode External Interrupt
-    uint32_t irq = virtio_reg_read32(PLIC_SCLAIM(0), 0);
+    // 外部割り込みはブートしたハートだけが受ける (plic_init)
+    uint32_t irq = virtio_reg_read32(PLIC_SCLAIM(this_cpu()->id), 0);
 
-    if (irq == VIRTIO_KEYBOARD_IRQ) {
+    if (irq == VIRTIO_BLK_IRQ) {
+      handle_blk_interrupt();
+    } else if (irq == VIRTIO_KEYBOARD_IRQ) {
       handle_keyboard_interrupt();
     } else if (irq == VIRTIO_MOUSE_IRQ) {
       handle_mouse_interrupt();
+    } else if (irq == UART_IRQ) {
+      handle_uart_interrupt();
     }
 
     if (irq) {
-      virtio_reg_write32(PLIC_SCLAIM(0), 0, irq);
+      virtio_reg_write32(PLIC_SCLAIM(this_cpu()->id), 0, irq);
     }
   } else if (scause == SCAUSE_TIMER_INTERRUPT) {
-    // タイマー割り込み: 次の割り込みをセットしてコンテキストスイッチ
-    sbi_call(0, 0, 0, 0, 0, 0, 0, 0); // タイマーリセット (OpenSBI依存)
-
-    // 次のタイマー設定 (10ms後)
-    uint64_t current_time;
-    __asm__ volatile("rdtime %0" : "=r"(current_time));
-    sbi_call(current_time + 100000, 0, 0, 0, 0, 0, 0, 0); // 100000tick後
-
-    yield();
+    handle_timer_interrupt();
+  } else if (scause == SCAUSE_SOFTWARE_INTERRUPT) {
+    handle_ipi();
   } else {
-    PANIC("unexpected trap scause=%x, stval=%x, sepc=%x\n", scause, stval,
-          user_pc);
+    user_fault(scause, stval, f->sepc);
   }
-  WRITE_CSR(sepc, user_pc);
+
+  // より優先度の高いプロセスが起床していれば切り替える
+  if (need_resched)
+    yield();
+  kernel_unlock();
 }
 
 __attribute__((naked)) __attribute__((aligned(4))) void kernel_entry(void) {
   __asm__ __volatile__("csrrw sp, sscratch, sp\n"
-                       "addi sp, sp, -4 * 31\n"
+                       "addi sp, sp, -4 * 32\n"
                        "sw ra,  4 * 0(sp)\n"
                        "sw gp,  4 * 1(sp)\n"
                        "sw tp,  4 * 2(sp)\n"
@@ -191,15 +389,25 @@ __attribute__((naked)) __attribute__((aligned(4))) void kernel_entry(void) {
                        "sw s10, 4 * 28(sp)\n"
                        "sw s11, 4 * 29(sp)\n"
 
+                       // ユーザーのtpは使えないので、スタックの最上部から読む
+                       "lw tp, 4 * 32(sp)\n"
+
                        "csrr a0, sscratch\n"
                        "sw a0, 4 * 30(sp)\n"
+                       "csrr a0, sepc\n"
+                       "sw a0, 4 * 31(sp)\n"
 
-                       "addi a0, sp, 4 * 31\n"
+                       "addi a0, sp, 4 * 32\n"
                        "csrw sscratch, a0\n"
 
                        "mv a0, sp\n"
                        "call handle_trap\n"
 
+                       ".global trap_return\n"
+                       "trap_return:\n"
+                       "lw a0,  4 * 31(sp)\n"
+                       "csrw sepc, a0\n"
+
                        "lw ra,  4 * 0(sp)\n"
                        "lw gp,  4 * 1(sp)\n"
                        "lw tp,  4 * 2(sp)\n"
@@ -0,0 +1,35 @@
+#include "common.h"
+#include "kernel.h"
+
+// シリアルコンソールの受信は割り込みで受け取り、getcharまで溜めておく
+char uart_queue_buf[UART_QUEUE_SIZE];
+struct ring uart_queue;
+
+static uint8_t uart_read(unsigned reg) {
+  return *((volatile uint8_t *)(UART_BASE + reg));
+}
+
+static void uart_write(unsigned reg, uint8_t value) {
+  *((volatile uint8_t *)(UART_BASE + reg)) = value;
+}
+
+// 送信はこれまで通りSBI経由で、受信割り込みだけを有効にする
+void uart_init(void) {
+  ring_init(&uart_queue, uart_queue_buf, UART_QUEUE_SIZE, sizeof(char));
+  uart_write(UART_IER, UART_IER_RX);
+}
+
+void handle_uart_interrupt(void) {
+  while (uart_read(UART_LSR) & UART_LSR_DR) {
+    char ch = uart_read(UART_RBR);
+    ring_push(&uart_queue, &ch); // 溢れた分は捨てる
+  }
+  wake_up(&input_wq);
+}
+
+int uart_getc(void) {
+  char ch;
+  if (!ring_pop(&uart_queue, &ch))
+    return -1;
+  return (uint8_t)ch;
+}
@@ -2,55 +2,155 @@
 #include "kernel.h"
 
 struct virtio_virtq *blk_request_vq;
-struct virtio_blk_req *blk_req;
-paddr_t blk_req_paddr;
+struct kmem_cache *blk_req_cache;
 uint64_t blk_capacity;
 
-void read_write_disk(void *buf, unsigned sector, int is_write) {
-  if (sector >= blk_capacity / SECTOR_SIZE) {
-    printf("virtio: tried to read/write sector %d, but capacity is %d\n",
-           sector, blk_capacity / SECTOR_SIZE);
+// ディスクリプタの空きリストと、発行中の要求 (先頭ディスクリプタで引く)
+uint16_t blk_free_descs[VIRTQ_ENTRY_NUM];
+int blk_num_free_descs;
+struct blk_request *blk_inflight[VIRTQ_ENTRY_NUM];
+struct wait_queue blk_desc_wq;
+
+static int blk_alloc_desc(void) {
+  if (blk_num_free_descs == 0)
+    return -1;
+  return blk_free_descs[--blk_num_free_descs];
+}
+
+static void blk_free_desc(int index) {
+  blk_free_descs[blk_num_free_descs++] = index;
+}
+
+// 使用済みリングを処理して完了した要求の待ち手を起こす
+void handle_blk_interrupt(void) {
+  struct virtio_virtq *virtq = blk_request_vq;
+  if (!virtq)
     return;
+
+  spin_lock_irqsave(&virtq->lock);
+  uint32_t status =
+      virtio_reg_read32(VIRTIO_BLK_PADDR, VIRTIO_REG_INTERRUPT_STATUS);
+  virtio_reg_write32(VIRTIO_BLK_PADDR, VIRTIO_REG_INTERRUPT_ACK, status);
+
+  while (virtq->last_used_index != *virtq->used_index) {
+    __sync_synchronize();
+    struct virtq_used_elem *e =
+        &virtq->used.ring[virtq->last_used_index % VIRTQ_ENTRY_NUM];
+    int desc = e->id;
+    struct blk_request *r = blk_inflight[desc];
+    blk_inflight[desc] = NULL;
+
+    for (;;) {
+      uint16_t flags = virtq->descs[desc].flags;
+      int next = virtq->descs[desc].next;
+      blk_free_desc(desc);
+      if (!(flags & VIRTQ_DESC_F_NEXT))
+        break;
+      desc = next;
+    }
+
+    virtq->last_used_index++;
+    if (r) {
+      r->done = true;
+      wake_up(&r->wq);
+    }
   }
+  spin_unlock_irqrestore(&virtq->lock);
+  wake_up(&blk_desc_wq);
+}
 
-  blk_req->sector = sector;
-  blk_req->type = is_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+// スリープできない文脈 (起動中など) ではポーリングで完了を待つ
+static void blk_wait(struct wait_queue *wq) {
+  if (can_sleep())
+    sleep_on(wq);
+  else
+    handle_blk_interrupt();
+}
 
-  if (is_write) {
-    memcpy(blk_req->data, buf, SECTOR_SIZE);
+static void blk_request_submit(struct blk_request *r, const struct iovec *iov,
+                               int iovcnt, int is_write) {
+  struct virtio_virtq *virtq = blk_request_vq;
+  int ndescs = iovcnt + 2;
+  spin_lock_irqsave(&virtq->lock);
+  while (blk_num_free_descs < ndescs) {
+    // 完了の処理 (handle_blk_interrupt) も同じロックを取る
+    spin_unlock_irqrestore(&virtq->lock);
+    blk_wait(&blk_desc_wq);
+    spin_lock_irqsave(&virtq->lock);
   }
 
-  struct virtio_virtq *virtq = blk_request_vq;
-  virtq->descs[0].addr = blk_req_paddr;
-  virtq->descs[0].len = sizeof(uint32_t) * 2 + sizeof(uint64_t);
-  virtq->descs[0].flags = VIRTQ_DESC_F_NEXT;
-  virtq->descs[0].next = 1;
+  // ヘッダ, データ (iovecごとに1つ), ステータスの順につなぐ
+  int head = blk_alloc_desc();
+  virtq->descs[head].addr = (paddr_t)&r->hdr;
+  virtq->descs[head].len = sizeof(r->hdr);
+  virtq->descs[head].flags = VIRTQ_DESC_F_NEXT;
+
+  int prev = head;
+  for (int i = 0; i < iovcnt; i++) {
+    int d = blk_alloc_desc();
+    virtq->descs[prev].next = d;
+    virtq->descs[d].addr = (paddr_t)iov[i].base;
+    virtq->descs[d].len = iov[i].len;
+    virtq->descs[d].flags =
+        VIRTQ_DESC_F_NEXT | (is_write ? 0 : VIRTQ_DESC_F_WRITE);
+    prev = d;
+  }
 
-  virtq->descs[1].addr = blk_req_paddr + offsetof(struct virtio_blk_req, data);
-  virtq->descs[1].len = SECTOR_SIZE;
-  virtq->descs[1].flags =
-      VIRTQ_DESC_F_NEXT | (is_write ? 0 : VIRTQ_DESC_F_WRITE);
-  virtq->descs[1].next = 2;
+  int d = blk_alloc_desc();
+  virtq->descs[prev].next = d;
+  virtq->descs[d].addr = (paddr_t)&r->status;
+  virtq->descs[d].len = sizeof(uint8_t);
+  virtq->descs[d].flags = VIRTQ_DESC_F_WRITE;
+  virtq->descs[d].next = 0;
+
+  r->done = false;
+  blk_inflight[head] = r;
+  virtq_kick(virtq, head);
+  spin_unlock_irqrestore(&virtq->lock);
+}
 
-  virtq->descs[2].addr =
-      blk_req_paddr + offsetof(struct virtio_blk_req, status);
-  virtq->descs[2].len = sizeof(uint8_t);
-  virtq->descs[2].flags = VIRTQ_DESC_F_WRITE;
+// 連続するnsectors個のセクタを1つの要求でiovecのバッファへ読み書きする
+int blk_submit(unsigned sector, unsigned nsectors, const struct iovec *iov,
+               int iovcnt, int is_write) {
+  if (sector + nsectors > blk_capacity / SECTOR_SIZE) {
+    printf("virtio: tried to read/write sector %d-%d, but capacity is %d\n",
+           sector, sector + nsectors - 1, blk_capacity / SECTOR_SIZE);
+    return -1;
+  }
 
-  virtq_kick(virtq, 0);
+  if (iovcnt < 1 || iovcnt > BLK_MAX_SEGS)
+    PANIC("invalid iovcnt %d", iovcnt);
 
-  while (virtq_is_busy(virtq)) {
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    if (iov[i].len == 0 || iov[i].len % SECTOR_SIZE != 0)
+      PANIC("invalid iovec length %d", iov[i].len);
+    total += iov[i].len;
   }
+  if (total != nsectors * SECTOR_SIZE)
+    PANIC("iovec length %d does not match %d sectors", total, nsectors);
+
+  struct blk_request *r = kmem_cache_alloc(blk_req_cache);
+  r->wq.head = NULL;
+  r->hdr.type = is_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+  r->hdr.reserved = 0;
+  r->hdr.sector = sector;
+  r->status = 0xff;
 
-  if (blk_req->status != 0) {
+  blk_request_submit(r, iov, iovcnt, is_write);
+
+  while (!r->done)
+    blk_wait(&r->wq);
+
+  int ret = 0;
+  if (r->status != 0) {
     printf("virtio: warn: failed to read/write disk sector=%d status=%d\n",
-           sector, blk_req->status);
-    return;
+           sector, r->status);
+    ret = -1;
   }
 
-  if (!is_write) {
-    memcpy(buf, blk_req->data, SECTOR_SIZE);
-  }
+  kmem_cache_free(blk_req_cache, r);
+  return ret;
 }
 
 void virtio_blk_init(void) {
@@ -70,7 +170,7 @@ void virtio_blk_init(void) {
                             VIRTIO_STATUS_DRIVER);
   virtio_reg_write32(VIRTIO_BLK_PADDR, VIRTIO_REG_PAGE_SIZE, PAGE_SIZE);
 
-  blk_request_vq = virtq_init(VIRTIO_BLK_PADDR, 0);
+  blk_request_vq = virtq_init(VIRTIO_BLK_PADDR, 0, "virtio_blk");
 
   virtio_reg_write32(VIRTIO_BLK_PADDR, VIRTIO_REG_DEVICE_STATUS,
                      VIRTIO_STATUS_DRIVER_OK);
@@ -80,7 +180,8 @@ void virtio_blk_init(void) {
       SECTOR_SIZE;
   printf("blk_capacity: %d\n", (int)blk_capacity);
 
-  blk_req_paddr =
-      alloc_pages(align_up(sizeof(*blk_req), PAGE_SIZE) / PAGE_SIZE);
-  blk_req = (struct virtio_blk_req *)blk_req_paddr;
+  blk_req_cache =
+      kmem_cache_create("virtio_blk_req", sizeof(struct blk_request));
+  for (int i = VIRTQ_ENTRY_NUM - 1; i >= 0; i--)
+    blk_free_desc(i);
 }
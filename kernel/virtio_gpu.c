@@ -10,19 +10,29 @@ uint32_t *framebuffer;
 
 extern uint8_t font_bitmap[256][16];
 
+// カーネルスタックは物理アドレスと一致しないので、要求はここにコピーして渡す
+uint8_t gpu_req_buf[GPU_REQ_MAX] __attribute__((aligned(16)));
+
+// 要求バッファも共有なので、応答が返るまでロックを持ち続ける
 void virtio_gpu_send_req(void *req, int len) {
-  struct virtio_gpu_ctrl_hdr *hdr = (struct virtio_gpu_ctrl_hdr *)req;
+  if (len > GPU_REQ_MAX)
+    PANIC("gpu request too large: %d", len);
+
+  struct virtio_virtq *virtq = gpu_control_vq;
+  spin_lock_irqsave(&virtq->lock);
+  memcpy(gpu_req_buf, req, len);
+
+  struct virtio_gpu_ctrl_hdr *hdr = (struct virtio_gpu_ctrl_hdr *)gpu_req_buf;
   hdr->flags = VIRTIO_GPU_FLAG_FENCE;
   hdr->fence_id = 0;
   hdr->ctx_id = 0;
 
-  struct virtio_virtq *virtq = gpu_control_vq;
-  virtq->descs[0].addr = (uint32_t)req;
+  virtq->descs[0].addr = (uint32_t)gpu_req_buf;
   virtq->descs[0].len = len;
   virtq->descs[0].flags = VIRTQ_DESC_F_NEXT;
   virtq->descs[0].next = 1;
 
-  virtq->descs[1].addr = (uint32_t)req;
+  virtq->descs[1].addr = (uint32_t)gpu_req_buf;
   virtq->descs[1].len = sizeof(struct virtio_gpu_ctrl_hdr);
   virtq->descs[1].flags = VIRTQ_DESC_F_WRITE;
   virtq->descs[1].next = 0;
@@ -36,6 +46,7 @@ void virtio_gpu_send_req(void *req, int len) {
 
   while (virtq->last_used_index != *virtq->used_index) {
   }
+  spin_unlock_irqrestore(&virtq->lock);
 }
 
 void virtio_gpu_init(void) {
@@ -65,7 +76,7 @@ void virtio_gpu_init(void) {
 
   virtio_reg_write32(virtio_gpu_paddr, VIRTIO_REG_PAGE_SIZE, PAGE_SIZE);
 
-  gpu_control_vq = virtq_init(virtio_gpu_paddr, 0);
+  gpu_control_vq = virtq_init(virtio_gpu_paddr, 0, "virtio_gpu");
 
   virtio_reg_write32(virtio_gpu_paddr, VIRTIO_REG_DEVICE_STATUS,
                      VIRTIO_STATUS_DRIVER_OK);
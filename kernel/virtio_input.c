@@ -3,10 +3,11 @@
 
 struct virtio_virtq *keyboard_vq;
 struct virtio_input_event keyboard_event_bufs[VIRTQ_ENTRY_NUM];
-struct virtio_input_event keyboard_queue[64];
-int keyboard_head = 0;
-int keyboard_tail = 0;
+// 割り込みハンドラが入れてgetcharが取り出す (生産者・消費者とも1つ)
+struct virtio_input_event keyboard_queue_buf[KEYBOARD_QUEUE_SIZE];
+struct ring keyboard_queue;
 uint32_t keyboard_paddr = 0;
+struct wait_queue input_wq; // キー入力を待つプロセス
 
 struct virtio_virtq *mouse_vq;
 struct virtio_input_event mouse_event_bufs[VIRTQ_ENTRY_NUM];
@@ -14,21 +15,13 @@ uint32_t mouse_paddr = 0;
 int mouse_x = 0;
 int mouse_y = 0;
 
-void keyboard_push(struct virtio_input_event event) {
-  int next = (keyboard_head + 1) % 64;
-  if (next != keyboard_tail) {
-    keyboard_queue[keyboard_head] = event;
-    keyboard_head = next;
-  }
+void keyboard_push(const struct virtio_input_event *event) {
+  ring_push(&keyboard_queue, event); // 溢れた分は捨てる
 }
 
-struct virtio_input_event *keyboard_pop(void) {
-  if (keyboard_head == keyboard_tail) {
-    return NULL;
-  }
-  struct virtio_input_event *event = &keyboard_queue[keyboard_tail];
-  keyboard_tail = (keyboard_tail + 1) % 64;
-  return event;
+// スロットは次の割り込みで上書きされうるので、イベントはコピーして返す
+bool keyboard_pop(struct virtio_input_event *event) {
+  return ring_pop(&keyboard_queue, event);
 }
 
 int key2char(uint16_t code) {
@@ -50,25 +43,23 @@ int key2char(uint16_t code) {
   return 0;
 }
 
+// 届いている入力を1文字取り出す。なければ-1 (ブロックしない)
 long getchar(void) {
-  struct virtio_input_event *event = keyboard_pop();
-  if (event) {
-    if ((event->value == 1 || event->value == 2) && event->type == 1) {
-      int ch = key2char(event->code);
+  struct virtio_input_event event;
+  while (keyboard_pop(&event)) {
+    if ((event.value == 1 || event.value == 2) && event.type == 1) {
+      int ch = key2char(event.code);
       if (ch)
         return ch;
     }
   }
-  struct sbiret ret = sbi_call(0, 0, 0, 0, 0, 0, 0, 2);
-  if (ret.error != -1) {
-    return ret.error;
-  }
-  return -1;
+  return uart_getc();
 }
 
 void handle_keyboard_interrupt(void) {
   if (!keyboard_vq)
     return;
+  spin_lock_irqsave(&keyboard_vq->lock);
   while (keyboard_vq->last_used_index != *keyboard_vq->used_index) {
     struct virtq_used_elem *e =
         &keyboard_vq->used.ring[keyboard_vq->last_used_index % VIRTQ_ENTRY_NUM];
@@ -78,7 +69,7 @@ void handle_keyboard_interrupt(void) {
         (struct virtio_input_event *)keyboard_vq->descs[desc_idx].addr;
 
     if (event->type == 1) {
-      keyboard_push(*event);
+      keyboard_push(event);
     }
 
     keyboard_vq->avail.ring[keyboard_vq->avail.index % VIRTQ_ENTRY_NUM] =
@@ -88,6 +79,8 @@ void handle_keyboard_interrupt(void) {
   }
   __sync_synchronize();
   virtio_reg_write32(keyboard_paddr, VIRTIO_REG_QUEUE_NOTIFY, 0);
+  spin_unlock_irqrestore(&keyboard_vq->lock);
+  wake_up(&input_wq);
 }
 
 void handle_mouse_interrupt(void) {
@@ -97,6 +90,7 @@ void handle_mouse_interrupt(void) {
   static int prev_mouse_y = 0;
   bool updated = false;
 
+  spin_lock_irqsave(&mouse_vq->lock);
   while (mouse_vq->last_used_index != *mouse_vq->used_index) {
     struct virtq_used_elem *e =
         &mouse_vq->used.ring[mouse_vq->last_used_index % VIRTQ_ENTRY_NUM];
@@ -129,17 +123,21 @@ void handle_mouse_interrupt(void) {
     mouse_vq->last_used_index++;
   }
 
+  __sync_synchronize();
+  virtio_reg_write32(mouse_paddr, VIRTIO_REG_QUEUE_NOTIFY, 0);
+  spin_unlock_irqrestore(&mouse_vq->lock);
+
+  // 描画はGPUのキューのロックを取るので、マウスのキューのロックの外で行う
   if (updated) {
     draw_cursor(prev_mouse_x, prev_mouse_y, mouse_x, mouse_y);
     prev_mouse_x = mouse_x;
     prev_mouse_y = mouse_y;
   }
-
-  __sync_synchronize();
-  virtio_reg_write32(mouse_paddr, VIRTIO_REG_QUEUE_NOTIFY, 0);
 }
 
 void virtio_input_init(void) {
+  ring_init(&keyboard_queue, keyboard_queue_buf, KEYBOARD_QUEUE_SIZE,
+            sizeof(struct virtio_input_event));
   uint32_t *paddr = (uint32_t *)VIRTIO_BLK_PADDR;
   for (int i = 0; i < 8; i++) {
     uint32_t magic = paddr[0];
@@ -154,7 +152,9 @@ void virtio_input_init(void) {
                                 VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
       virtio_reg_write32(base, VIRTIO_REG_PAGE_SIZE, PAGE_SIZE);
 
-      struct virtio_virtq *vq = virtq_init(base, 0);
+      const char *name =
+          irq == VIRTIO_KEYBOARD_IRQ ? "virtio_keyboard" : "virtio_mouse";
+      struct virtio_virtq *vq = virtq_init(base, 0, name);
 
       if (irq == VIRTIO_KEYBOARD_IRQ) {
         printf("found keyboard at %x\n", base);
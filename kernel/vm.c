@@ -0,0 +1,306 @@
+#include "common.h"
+#include "kernel.h"
+
+static struct vm_area *vm_find(struct process *proc, vaddr_t addr) {
+  for (int i = 0; i < VMAS_MAX; i++) {
+    struct vm_area *vma = &proc->vmas[i];
+    if (vma->start && vma->start <= addr && addr < vma->end)
+      return vma;
+  }
+  return NULL;
+}
+
+// ページキャッシュのページをそのままユーザー空間にマッピングする (コピーなし)
+// ページは最初にアクセスされた時にマッピングする。失敗したらMAP_FAILED
+vaddr_t vm_mmap(struct process *proc, struct file *file, uint32_t offset,
+                size_t len, int prot) {
+  if (len == 0 || offset % PAGE_SIZE != 0)
+    return (vaddr_t)MAP_FAILED;
+
+  // ファイルの末尾を越える範囲はマッピングできない
+  // (書き戻しでファイルがゴミで伸びてしまう)
+  if (offset > file->size || len > file->size - offset)
+    return (vaddr_t)MAP_FAILED;
+
+  size_t size = align_up(len, PAGE_SIZE);
+  if (size > MMAP_END - proc->mmap_top)
+    return (vaddr_t)MAP_FAILED;
+
+  struct vm_area *vma = NULL;
+  for (int i = 0; i < VMAS_MAX; i++) {
+    if (!proc->vmas[i].start) {
+      vma = &proc->vmas[i];
+      break;
+    }
+  }
+  if (!vma)
+    return (vaddr_t)MAP_FAILED;
+
+  vma->start = proc->mmap_top;
+  vma->end = vma->start + size;
+  vma->file = file;
+  vma->offset = offset;
+  vma->filesz = size;
+  vma->prot = prot | PROT_READ;
+  vma->flags = VM_SHARED;
+  proc->mmap_top = vma->end;
+  return vma->start;
+}
+
+// ユーザーが書き込んだページ (PTEのDビット) をページキャッシュに反映する
+static void vm_collect_dirty(struct process *proc, struct vm_area *vma) {
+  bool dirty = false;
+  for (vaddr_t addr = vma->start; addr < vma->end; addr += PAGE_SIZE) {
+    uint32_t *pte = walk_pte(proc->page_table, addr);
+    if (!pte || !(*pte & PAGE_V) || !(*pte & PAGE_D))
+      continue;
+
+    // 切り詰められてキャッシュから外れたページは書き戻さない
+    paddr_t paddr = (*pte >> 10) * PAGE_SIZE;
+    uint32_t index = (vma->offset + (addr - vma->start)) / PAGE_SIZE;
+    if (index < vma->file->page_cap && vma->file->pages[index] == paddr) {
+      paddr_to_page(paddr)->flags |= PG_DIRTY;
+      dirty = true;
+    }
+    *pte &= ~PAGE_D;
+  }
+
+  flush_tlb_asid(proc->asid);
+  if (dirty)
+    vma->file->dirty = true;
+}
+
+int vm_msync(struct process *proc, vaddr_t addr) {
+  struct vm_area *vma = vm_find(proc, addr);
+  if (!vma)
+    return -1;
+
+  // プライベートなマッピングへの書き込みはファイルに反映しない
+  if (!(vma->flags & VM_SHARED))
+    return 0;
+
+  vm_collect_dirty(proc, vma);
+  return fs_fsync(vma->file);
+}
+
+// マッピング全体を外す。ダーティなページは先に書き戻す
+int vm_munmap(struct process *proc, vaddr_t addr) {
+  struct vm_area *vma = vm_find(proc, addr);
+  if (!vma || vma->start != addr)
+    return -1;
+
+  vm_msync(proc, addr);
+  for (vaddr_t va = vma->start; va < vma->end; va += PAGE_SIZE)
+    unmap_page(proc->page_table, va);
+  flush_tlb_asid(proc->asid);
+
+  vma->start = 0;
+  vma->file = NULL;
+  return 0;
+}
+
+void vm_unmap_all(struct process *proc) {
+  for (int i = 0; i < VMAS_MAX; i++) {
+    if (proc->vmas[i].start)
+      vm_munmap(proc, proc->vmas[i].start);
+  }
+}
+
+// ゼロ埋めしたページを割り当ててマッピングする。メモリが足りなければfalse
+static bool vm_map_new_page(struct process *proc, vaddr_t va, uint32_t flags) {
+  paddr_t page = try_alloc_pages(1);
+  if (!page)
+    return false;
+  if (!try_map_page(proc->page_table, va, page, flags)) {
+    free_pages(page, 1);
+    return false;
+  }
+  return true;
+}
+
+// コピーオンライトのページに書き込まれたので、自分専用のページにする
+static bool vm_cow(struct process *proc, vaddr_t va, uint32_t *pte) {
+  paddr_t paddr = (*pte >> 10) * PAGE_SIZE;
+  struct page *page = paddr_to_page(paddr);
+  if (page->refcount == 1 && !(page->flags & PG_CACHE)) {
+    // 他のプロセスがもう共有していなければコピーは不要
+    *pte = (*pte & ~PAGE_COW) | PAGE_W;
+  } else {
+    // メモリが足りなければこのプロセスだけを終了させる
+    paddr_t copy = try_alloc_pages(1);
+    if (!copy)
+      return false;
+    memcpy((void *)copy, (void *)paddr, PAGE_SIZE);
+    uint32_t flags = (*pte & PTE_FLAGS & ~PAGE_COW) | PAGE_W;
+    map_page(proc->page_table, va, copy, flags); // PTEは既にある
+    put_page(paddr);
+  }
+
+  flush_tlb_page(va, proc->asid);
+  return true;
+}
+
+// ページフォルトを処理する。処理できなければfalse
+// (メモリが足りない時もfalseを返し、カーネルは止めない)
+bool vm_handle_fault(struct process *proc, vaddr_t addr, int access) {
+  vaddr_t va = addr & ~(PAGE_SIZE - 1);
+  uint32_t *pte = walk_pte(proc->page_table, va);
+  if (pte && (*pte & PAGE_V)) {
+    if ((access & PROT_WRITE) && (*pte & PAGE_COW))
+      return vm_cow(proc, va, pte);
+    return false; // 権限違反
+  }
+
+  // ヒープのページは最初に触れた時に割り当てる (ゼロ埋めしたページ)
+  if (addr >= proc->heap_start && addr < proc->brk &&
+      addr < USER_STACK_TOP - USER_STACK_SIZE) {
+    if (access & PROT_EXEC)
+      return false;
+    return vm_map_new_page(proc, va, PAGE_U | PAGE_R | PAGE_W);
+  }
+
+  struct vm_area *vma = vm_find(proc, addr);
+  if (!vma || (access & ~vma->prot))
+    return false;
+
+  uint32_t flags = PAGE_U | PAGE_R;
+  if (vma->prot & PROT_EXEC)
+    flags |= PAGE_X;
+
+  uint32_t off = va - vma->start;
+  uint32_t index = (vma->offset + off) / PAGE_SIZE;
+  if (vma->file && (vma->flags & VM_SHARED)) {
+    // 共有マッピングはページキャッシュのページをそのまま使う
+    paddr_t page = fs_get_page(vma->file, index);
+    if (!page)
+      return false;
+    if (vma->prot & PROT_WRITE)
+      flags |= PAGE_W;
+    if (!try_map_page(proc->page_table, va, page, flags))
+      return false;
+  } else if (vma->file && off + PAGE_SIZE <= vma->filesz) {
+    // プライベートなマッピングもページキャッシュを読み取り専用で共有し、
+    // 書き込まれた時にコピーする
+    paddr_t page = fs_get_page(vma->file, index);
+    if (!page)
+      return false;
+    if (vma->prot & PROT_WRITE)
+      flags |= PAGE_COW;
+    if (!try_map_page(proc->page_table, va, page, flags))
+      return false;
+    if (access & PROT_WRITE)
+      return vm_cow(proc, va, walk_pte(proc->page_table, va));
+  } else {
+    // ファイルの末尾を含むページとbss・スタックはゼロ埋めした専用のページ
+    paddr_t page = try_alloc_pages(1);
+    if (!page)
+      return false;
+    if (vma->file && off < vma->filesz &&
+        fs_read(vma->file, vma->offset + off, (void *)page,
+                vma->filesz - off) < 0) {
+      free_pages(page, 1);
+      return false;
+    }
+    if (vma->prot & PROT_WRITE)
+      flags |= PAGE_W;
+    if (!try_map_page(proc->page_table, va, page, flags)) {
+      free_pages(page, 1);
+      return false;
+    }
+  }
+  return true;
+}
+
+// ユーザーのページにアクセスできるか調べ、必要ならその場で割り当てる
+static bool vm_page_ok(struct process *proc, vaddr_t va, int access) {
+  uint32_t *pte = walk_pte(proc->page_table, va);
+  if (pte && (*pte & PAGE_V)) {
+    if (!(*pte & PAGE_U))
+      return false;
+    if (!(access & PROT_WRITE) || (*pte & PAGE_W))
+      return true;
+  }
+  return vm_handle_fault(proc, va, access);
+}
+
+// カーネル内のページフォルトは扱えないので、触れる前に検証しておく
+bool vm_user_ok(struct process *proc, vaddr_t addr, size_t len, int access) {
+  if (len == 0)
+    return true;
+
+  vaddr_t end = addr + len;
+  if (end < addr || end > MMAP_END)
+    return false;
+
+  for (vaddr_t va = addr & ~(PAGE_SIZE - 1); va < end; va += PAGE_SIZE) {
+    if (!vm_page_ok(proc, va, access))
+      return false;
+  }
+  return true;
+}
+
+bool vm_user_str_ok(struct process *proc, const char *str) {
+  vaddr_t va = (vaddr_t)str;
+  while (va < MMAP_END) {
+    if (!vm_page_ok(proc, va, PROT_READ))
+      return false;
+
+    // このページの中で文字列が終わっていれば終了
+    vaddr_t page_end = align_up(va + 1, PAGE_SIZE);
+    for (; va < page_end; va++) {
+      if (*(const char *)va == '\0')
+        return true;
+    }
+  }
+  return false;
+}
+
+// brkを動かすだけで、ページは割り当てない。縮めた分は解放する
+int vm_sbrk(struct process *proc, int increment) {
+  uintptr_t old_brk = proc->brk;
+  uintptr_t new_brk = old_brk + increment;
+  if ((increment < 0 && (new_brk > old_brk || new_brk < proc->heap_start)) ||
+      (increment > 0 &&
+       (new_brk < old_brk || new_brk > USER_STACK_TOP - USER_STACK_SIZE)))
+    return -1;
+
+  if (increment < 0) {
+    uintptr_t start_page = align_up(new_brk, PAGE_SIZE);
+    uintptr_t end_page = align_up(old_brk, PAGE_SIZE);
+    for (uintptr_t addr = start_page; addr < end_page; addr += PAGE_SIZE)
+      unmap_page(proc->page_table, addr);
+    flush_tlb_asid(proc->asid);
+  }
+
+  proc->brk = new_brk;
+  return old_brk;
+}
+
+// 親のページテーブルを複製する。書き込み可能なページは読み取り専用で共有し、
+// 最初に書き込んだ側がコピーを作る
+uint32_t *vm_fork_page_table(uint32_t *parent) {
+  uint32_t *child = create_page_table();
+  for (int vpn1 = 0; vpn1 < 1024; vpn1++) {
+    uint32_t pte1 = parent[vpn1];
+    if (!(pte1 & PAGE_V) || (pte1 & (PAGE_R | PAGE_W | PAGE_X)))
+      continue;
+
+    uint32_t *table0 = (uint32_t *)((pte1 >> 10) * PAGE_SIZE);
+    for (int vpn0 = 0; vpn0 < 1024; vpn0++) {
+      uint32_t *pte = &table0[vpn0];
+      if (!(*pte & PAGE_V) || !(*pte & PAGE_U))
+        continue;
+
+      // mmapしたページキャッシュは書き込みもファイルと共有する
+      paddr_t paddr = (*pte >> 10) * PAGE_SIZE;
+      if ((*pte & PAGE_W) && !(paddr_to_page(paddr)->flags & PG_CACHE))
+        *pte = (*pte & ~PAGE_W) | PAGE_COW;
+
+      vaddr_t va = (vpn1 << 22) | (vpn0 << 12);
+      map_page(child, va, paddr, *pte & PTE_FLAGS);
+    }
+  }
+
+  flush_tlb_asid(current_proc->asid);
+  return child;
+}
@@ -57,6 +57,8 @@ void main(void) {
       ls();
     } else if (strcmp(cmdline, "ps") == 0) { // psコマンド
       ps();
+    } else if (strcmp(cmdline, "lockstat") == 0) { // ロックの統計
+      lockstat();
     } else if (strcmp(cmdline, "memtest") == 0) { // mallocテスト
       void *p1 = malloc(100);
       void *p2 = malloc(200);
@@ -64,7 +66,15 @@ void main(void) {
       free(p1);
       free(p2);
     } else if (cmdline[0] != '\0') {
-      printf("unknown command: %s\n", cmdline);
+      // 組み込みコマンドでなければディスク上のプログラムを実行する
+      int pid = fork();
+      if (pid == 0) {
+        exec(cmdline);
+        printf("unknown command: %s\n", cmdline);
+        exit();
+      } else if (pid > 0) {
+        wait();
+      }
     }
   }
 }
@@ -1,20 +1,24 @@
 #include "user.h"
 
-extern char __stack_top[];
-
-int syscall(int sysno, int arg0, int arg1, int arg2) {
+// 4つ目の引数はa4で渡す (a3はシステムコール番号)
+int syscall4(int sysno, int arg0, int arg1, int arg2, int arg3) {
   register int a0 __asm__("a0") = arg0;
   register int a1 __asm__("a1") = arg1;
   register int a2 __asm__("a2") = arg2;
   register int a3 __asm__("a3") = sysno;
+  register int a4 __asm__("a4") = arg3;
 
   __asm__ __volatile__("ecall"
                        : "=r"(a0)
-                       : "r"(a0), "r"(a1), "r"(a2), "r"(a3)
+                       : "r"(a0), "r"(a1), "r"(a2), "r"(a3), "r"(a4)
                        : "memory");
   return a0;
 }
 
+int syscall(int sysno, int arg0, int arg1, int arg2) {
+  return syscall4(sysno, arg0, arg1, arg2, 0);
+}
+
 __attribute__((noreturn)) void exit(void) {
   syscall(SYS_EXIT, 0, 0, 0);
   for (;;) {
@@ -33,8 +37,40 @@ int writefile(const char *filename, const char *buf, int len) {
   return syscall(SYS_WRITEFILE, (int)filename, (int)buf, len);
 }
 
+int open(const char *filename, int flags) {
+  return syscall(SYS_OPEN, (int)filename, flags, 0);
+}
+
+int read(int fd, void *buf, int len) {
+  return syscall(SYS_READ, fd, (int)buf, len);
+}
+
+int write(int fd, const void *buf, int len) {
+  return syscall(SYS_WRITE, fd, (int)buf, len);
+}
+
+int lseek(int fd, int offset, int whence) {
+  return syscall(SYS_LSEEK, fd, offset, whence);
+}
+
+int close(int fd) { return syscall(SYS_CLOSE, fd, 0, 0); }
+
+int fork(void) { return syscall(SYS_FORK, 0, 0, 0); }
+int wait(void) { return syscall(SYS_WAIT, 0, 0, 0); }
+int exec(const char *path) { return syscall(SYS_EXEC, (int)path, 0, 0); }
+int sleep(int ms) { return syscall(SYS_SLEEP, ms, 0, 0); }
+int setprio(int prio) { return syscall(SYS_SETPRIO, prio, 0, 0); }
+
+void *mmap(int fd, int offset, int len, int prot) {
+  return (void *)syscall4(SYS_MMAP, fd, offset, len, prot);
+}
+
+int munmap(void *addr) { return syscall(SYS_MUNMAP, (int)addr, 0, 0); }
+int msync(void *addr) { return syscall(SYS_MSYNC, (int)addr, 0, 0); }
+
 int ls(void) { return syscall(SYS_LS, 0, 0, 0); }
 int ps(void) { return syscall(SYS_PS, 0, 0, 0); }
+int lockstat(void) { return syscall(SYS_LOCKSTAT, 0, 0, 0); }
 int sbrk(int incr) { return syscall(SYS_SBRK, incr, 0, 0); }
 
 // ユーザーランド用 malloc/free
@@ -124,9 +160,7 @@ void free(void *ptr) {
 
 __attribute__((section(".text.start"))) __attribute__((naked)) void
 start(void) {
-  __asm__ __volatile__("mv sp, %[stack_top]\n"
-                       "call main\n"
-                       "call exit\n"
-                       :
-                       : [stack_top] "r"(__stack_top));
+  // spはカーネルがスタック領域の上端に設定している
+  __asm__ __volatile__("call main\n"
+                       "call exit\n");
 }
\ No newline at end of file
@@ -6,8 +6,22 @@ void putchar(char ch);
 int getchar(void);
 int readfile(const char *filename, char *buf, int len);
 int writefile(const char *filename, const char *buf, int len);
+int open(const char *filename, int flags);
+int read(int fd, void *buf, int len);
+int write(int fd, const void *buf, int len);
+int lseek(int fd, int offset, int whence);
+int close(int fd);
+int fork(void);
+int wait(void);
+int exec(const char *path);
+int sleep(int ms);
+int setprio(int prio);
+void *mmap(int fd, int offset, int len, int prot);
+int munmap(void *addr);
+int msync(void *addr);
 int ls(void);
 int ps(void);
+int lockstat(void);
 int sbrk(int incr);
 void *malloc(size_t size);
 void free(void *ptr);
\ No newline at end of file